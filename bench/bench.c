@@ -0,0 +1,463 @@
+/*
+ * benchmark harness: runs each workload on each engine N times, pinned
+ * to one cpu, and reports instructions per second with a confidence
+ * interval. results can be saved and later compared against.
+ *
+ *   gcc -O2 -o lc3_bench bench/bench.c lc3.c -DLC3_NO_MAIN
+ *   ./lc3_bench [-n runs] [-c cpu] [-w workload,...] [-e engine,...]
+ *               [--save file] [--baseline file] [--threshold percent]
+ *
+ * run it from the top of the repository so games/ can be found.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../lc3.h"
+
+/* ------------------- workloads ------------------- */
+
+/* counted loop that sums its counter, ADD R3,R3,R1 / ADD R1,R1,#-1 / BRp
+   inside an outer loop. the ADD to R3 keeps it from being a delay loop,
+   which the interpreter would skip instead of dispatching */
+static const uint16_t countsum[] = {
+    0x2407, 0x2207, 0x16C1, 0x127F, 0x03FD, 0x14BF, 0x03FA, 0xF025, 0x03E8, 0x2710
+};
+
+/* copies 1000 words with LDR/STR, 3000 times */
+static const uint16_t memcopy[] = {
+    0x240C, 0xE80E, 0x2A0C, 0x220A, 0x6700, 0x7740, 0x1921, 0x1B61, 0x127F,
+    0x03FA, 0x14BF, 0x03F5, 0xF025, 0x0BB8, 0x03E8, 0x5000, 0x0001
+};
+
+/* recursive fib(26) through JSR and an R6 stack */
+static const uint16_t fib[] = {
+    0x2C17, 0x5020, 0x102F, 0x102B, 0x4801, 0xF025, 0x123E, 0x080F, 0x1DBF,
+    0x7F80, 0x1DBF, 0x7180, 0x103F, 0x4FF8, 0x6380, 0x7180, 0x107E, 0x4FF4,
+    0x6380, 0x1001, 0x1DA1, 0x6F80, 0x1DA1, 0xC1C0, 0xF000
+};
+
+/* PUTS of the text that follows, 32767 times */
+static const uint16_t puts_loop[] = {
+    0x2205, 0xE005, 0xF022, 0x127F, 0x03FC, 0xF025, 0x7FFF
+};
+
+struct workload
+{
+    const char* name;
+    const char* image;          /* image file, or NULL for words */
+    const uint16_t* words;      /* loaded at x3000 */
+    uint32_t count;
+    const char* text;           /* string placed right after the words */
+    const char* input;          /* recorded keyboard input */
+    uint64_t budget;            /* instructions per run at most */
+};
+
+#define KERNEL(words) words, sizeof(words) / sizeof(words[0])
+
+static const struct workload workloads[] = {
+    { "countsum", NULL, KERNEL(countsum), NULL, "", 100000000 },
+    { "memcpy", NULL, KERNEL(memcopy), NULL, "", 100000000 },
+    { "fib", NULL, KERNEL(fib), NULL, "", 100000000 },
+    { "puts", NULL, KERNEL(puts_loop), "the quick brown fox jumps over the lazy dog\n", "", 100000000 },
+    { "2048", "games/2048.obj", NULL, 0, NULL,
+      "y" "wasdwasdwasdwasdwasdwasdwasdwasdwasdwasd" "ddddssssaaaawwww" "wasdwasdwasdwasdwasd", 20000000 },
+    { "rogue", "games/rogue.obj", NULL, 0, NULL,
+      " " "ddddssssddddwwwwddddssssdddd" "ssssddddssssddddwwwwdddd", 20000000 },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* ------------------- engines ------------------- */
+
+/* an engine is the interpreter with a set of tools attached */
+struct engine
+{
+    const char* name;
+    void (*attach)(struct lc3_vm* vm);
+};
+
+static FILE* null_out;
+
+static void attach_none(struct lc3_vm* vm) { (void)vm; }
+static void attach_profile(struct lc3_vm* vm) { lc3_profile_enable(vm); }
+static void attach_sanitize(struct lc3_vm* vm) { lc3_sanitize_enable(vm, null_out); }
+static void attach_heatmap(struct lc3_vm* vm) { lc3_heatmap_enable(vm, 100000); }
+
+static const struct engine engines[] = {
+    { "interp", attach_none },
+    { "profile", attach_profile },
+    { "sanitize", attach_sanitize },
+    { "heatmap", attach_heatmap },
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+/* ------------------- counters ------------------- */
+
+/* host cycles and instructions of this thread, when the kernel allows */
+struct counters
+{
+    int cycles_fd;
+    int instructions_fd;
+};
+
+static int open_counter(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void counters_open(struct counters* c)
+{
+    c->cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    c->instructions_fd = c->cycles_fd < 0 ? -1 : open_counter(PERF_COUNT_HW_INSTRUCTIONS, c->cycles_fd);
+}
+
+static void counters_start(struct counters* c)
+{
+    if (c->cycles_fd < 0) { return; }
+    ioctl(c->cycles_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->cycles_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* cycles since counters_start, 0 when unavailable */
+static uint64_t counters_stop(struct counters* c)
+{
+    uint64_t cycles = 0;
+    if (c->cycles_fd < 0) { return 0; }
+    ioctl(c->cycles_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(c->cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles)) { return 0; }
+    return cycles;
+}
+
+/* ------------------- runs ------------------- */
+
+struct sample
+{
+    double seconds;
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* load a workload into a fresh vm, returns NULL if it cannot be loaded */
+static struct lc3_vm* prepare(const struct workload* w, const struct engine* e)
+{
+    struct lc3_vm* vm = lc3_pool_alloc(1);
+    if (!vm) { return NULL; }
+    if (!lc3_init(vm))
+    {
+        lc3_pool_free(vm, 1);
+        return NULL;
+    }
+
+    int ok;
+    if (w->image)
+    {
+        ok = lc3_load(vm, w->image);
+    }
+    else
+    {
+        ok = lc3_load_words(vm, 0x3000, w->words, w->count);
+        for (uint32_t i = 0; ok && w->text && i <= strlen(w->text); ++i)
+        {
+            uint16_t c = (uint8_t)w->text[i];
+            ok = lc3_load_words(vm, 0x3000 + w->count + i, &c, 1);
+        }
+    }
+    if (!ok)
+    {
+        lc3_free(vm);
+        lc3_pool_free(vm, 1);
+        return NULL;
+    }
+
+    lc3_push_input(vm, w->input, strlen(w->input));
+    lc3_close_input(vm);
+    e->attach(vm);
+    return vm;
+}
+
+static void release(struct lc3_vm* vm)
+{
+    lc3_free(vm);
+    lc3_pool_free(vm, 1);
+}
+
+/* one timed run to HALT, a fault or the budget */
+static int run_once(const struct workload* w, const struct engine* e, struct counters* c, struct sample* s)
+{
+    struct lc3_vm* vm = prepare(w, e);
+    if (!vm) { return 0; }
+
+    char output[LC3_OUTPUT_MAX];
+    counters_start(c);
+    double start = now();
+    for (;;)
+    {
+        uint64_t left = w->budget - vm->instructions;
+        enum lc3_status status = lc3_run(vm, left < (1 << 20) ? left : (1 << 20));
+        lc3_read_output(vm, output, sizeof(output));
+        if (status == LC3_HALTED || status == LC3_FAULT || vm->instructions >= w->budget) { break; }
+    }
+    s->seconds = now() - start;
+    s->cycles = counters_stop(c);
+    s->instructions = vm->instructions;
+    release(vm);
+    return 1;
+}
+
+/* ------------------- statistics ------------------- */
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of sorted values */
+static double percentile(const double* sorted, int n, double p)
+{
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    if (rank < 1) { rank = 1; }
+    if (rank > n) { rank = n; }
+    return sorted[rank - 1];
+}
+
+static double median(double* values, int n)
+{
+    qsort(values, n, sizeof(*values), compare_doubles);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* 95% bootstrap interval of the median, with a fixed seed so reruns agree */
+#define BOOTSTRAP_ROUNDS 2000
+
+static void median_interval(const double* values, int n, double* low, double* high)
+{
+    double* medians = malloc(BOOTSTRAP_ROUNDS * sizeof(*medians));
+    double* resample = malloc(n * sizeof(*resample));
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int r = 0; r < BOOTSTRAP_ROUNDS; ++r)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            resample[i] = values[state % n];
+        }
+        medians[r] = median(resample, n);
+    }
+    qsort(medians, BOOTSTRAP_ROUNDS, sizeof(*medians), compare_doubles);
+    *low = percentile(medians, BOOTSTRAP_ROUNDS, 2.5);
+    *high = percentile(medians, BOOTSTRAP_ROUNDS, 97.5);
+    free(medians);
+    free(resample);
+}
+
+/* ------------------- baselines ------------------- */
+
+struct result
+{
+    char workload[32];
+    char engine[32];
+    double median;
+    double low;
+    double high;
+};
+
+static int load_baseline(const char* path, struct result* results, int max)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) { return -1; }
+    int n = 0;
+    while (n < max && fscanf(file, "%31s %31s %lf %lf %lf", results[n].workload, results[n].engine,
+        &results[n].median, &results[n].low, &results[n].high) == 5)
+    {
+        ++n;
+    }
+    fclose(file);
+    return n;
+}
+
+static const struct result* find_result(const struct result* results, int n, const char* workload, const char* engine)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        if (strcmp(results[i].workload, workload) == 0 && strcmp(results[i].engine, engine) == 0)
+        {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+/* ------------------- main ------------------- */
+
+/* whether name is in a comma separated list, NULL selects everything */
+static int selected(const char* list, const char* name)
+{
+    if (!list) { return 1; }
+    size_t len = strlen(name);
+    for (const char* p = list; (p = strstr(p, name)); p += len)
+    {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == 0)) { return 1; }
+    }
+    return 0;
+}
+
+static void usage()
+{
+    printf("lc3_bench [-n runs] [-c cpu] [-w workload,...] [-e engine,...]\n");
+    printf("          [--save file] [--baseline file] [--threshold percent]\n");
+    printf("workloads:");
+    for (size_t i = 0; i < WORKLOAD_COUNT; ++i) { printf(" %s", workloads[i].name); }
+    printf("\nengines:");
+    for (size_t i = 0; i < ENGINE_COUNT; ++i) { printf(" %s", engines[i].name); }
+    printf("\n");
+    exit(2);
+}
+
+#define RESULT_MAX 256
+
+int main(int argc, const char* argv[])
+{
+    int runs = 10;
+    int cpu = -1;
+    const char* workload_list = NULL;
+    const char* engine_list = NULL;
+    const char* save_path = NULL;
+    const char* baseline_path = NULL;
+    double threshold = 5.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-n") == 0 && has_value) { runs = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-c") == 0 && has_value) { cpu = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "-w") == 0 && has_value) { workload_list = argv[++i]; }
+        else if (strcmp(argv[i], "-e") == 0 && has_value) { engine_list = argv[++i]; }
+        else if (strcmp(argv[i], "--save") == 0 && has_value) { save_path = argv[++i]; }
+        else if (strcmp(argv[i], "--baseline") == 0 && has_value) { baseline_path = argv[++i]; }
+        else if (strcmp(argv[i], "--threshold") == 0 && has_value) { threshold = atof(argv[++i]); }
+        else { usage(); }
+    }
+    if (runs < 1) { usage(); }
+
+    /* stay on one cpu, the current one unless told otherwise */
+    if (cpu < 0) { cpu = sched_getcpu(); }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) { printf("warning: cannot pin to cpu %d\n", cpu); }
+
+    null_out = fopen("/dev/null", "w");
+    struct counters counters;
+    counters_open(&counters);
+
+    static struct result baseline[RESULT_MAX];
+    int baseline_count = 0;
+    if (baseline_path && (baseline_count = load_baseline(baseline_path, baseline, RESULT_MAX)) < 0)
+    {
+        printf("cannot read baseline: %s\n", baseline_path);
+        return 2;
+    }
+    FILE* save = save_path ? fopen(save_path, "w") : NULL;
+    if (save_path && !save)
+    {
+        printf("cannot write results: %s\n", save_path);
+        return 2;
+    }
+
+    printf("cpu %d, %d runs each, host counters %s\n", cpu, runs,
+        counters.cycles_fd >= 0 ? "on" : "unavailable");
+    printf("%-10s %-9s %12s %10s %10s %21s %7s  %s\n",
+        "workload", "engine", "instructions", "median", "p99", "95% ci of median", "cpi", "vs baseline");
+
+    double* ips = malloc(runs * sizeof(*ips));
+    double* sorted = malloc(runs * sizeof(*sorted));
+    int regressions = 0;
+    for (size_t wi = 0; wi < WORKLOAD_COUNT; ++wi)
+    {
+        const struct workload* w = &workloads[wi];
+        if (!selected(workload_list, w->name)) { continue; }
+        for (size_t ei = 0; ei < ENGINE_COUNT; ++ei)
+        {
+            const struct engine* e = &engines[ei];
+            if (!selected(engine_list, e->name)) { continue; }
+
+            /* one warm up run, not counted */
+            struct sample s;
+            if (!run_once(w, e, &counters, &s))
+            {
+                printf("%-10s %-9s cannot load %s\n", w->name, e->name, w->image);
+                break;
+            }
+
+            uint64_t cycles = 0, instructions = 0;
+            for (int r = 0; r < runs; ++r)
+            {
+                run_once(w, e, &counters, &s);
+                ips[r] = s.instructions / s.seconds;
+                cycles += s.cycles;
+                instructions += s.instructions;
+            }
+
+            memcpy(sorted, ips, runs * sizeof(*ips));
+            double mid = median(sorted, runs);
+            /* the slowest 1% of runs */
+            double p99 = percentile(sorted, runs, 1.0);
+            double low, high;
+            median_interval(ips, runs, &low, &high);
+
+            char cpi[16] = "n/a";
+            if (cycles) { snprintf(cpi, sizeof(cpi), "%.2f", (double)cycles / instructions); }
+
+            char verdict[48] = "";
+            const struct result* base = find_result(baseline, baseline_count, w->name, e->name);
+            if (base)
+            {
+                double change = 100.0 * (mid - base->median) / base->median;
+                const char* flag = "";
+                if (high < base->median * (1 - threshold / 100)) { flag = "  REGRESSION"; ++regressions; }
+                else if (low > base->median * (1 + threshold / 100)) { flag = "  improved"; }
+                snprintf(verdict, sizeof(verdict), "%+.1f%%%s", change, flag);
+            }
+
+            printf("%-10s %-9s %12llu %8.1fM %8.1fM   [%8.1fM, %8.1fM] %7s  %s\n",
+                w->name, e->name, (unsigned long long)s.instructions, mid / 1e6, p99 / 1e6,
+                low / 1e6, high / 1e6, cpi, verdict);
+            fflush(stdout);
+            if (save) { fprintf(save, "%s %s %.0f %.0f %.0f\n", w->name, e->name, mid, low, high); }
+        }
+    }
+
+    free(ips);
+    free(sorted);
+    if (save) { fclose(save); }
+    if (regressions) { printf("%d regression(s) beyond %.1f%%\n", regressions, threshold); }
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * scaling benchmark: runs the same set of guests on lc3::executor with
+ * 1..N worker threads and reports aggregate instructions per second, job
+ * latency percentiles and the executor's work stealing counters.
+ *
+ * vm contexts are laid out two ways, packed back to back in one array and
+ * padded to 128 byte line pairs. a gap between the two, together with
+ * the cache miss and HITM counts, points at false sharing between vms.
+ *
+ *   gcc -O2 -DLC3_NO_MAIN -c lc3.c
+ *   g++ -std=c++20 -O2 -pthread -o lc3_scaling bench/scaling.cpp lc3.o
+ *   ./lc3_scaling [-t threads] [-j jobs] [-b budget] [-s slice]
+ *                 [-x hitm_event] [image[=input] ...]
+ *
+ * -x takes the raw perf event code of the cpu's HITM event, for example
+ * 0x4d2 (MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM) on Skylake.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+#include "../lc3.hpp"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct program
+{
+    std::string path;
+    std::string input;
+};
+
+/* written by whichever worker finishes the job, so kept on its own line */
+struct alignas(64) job_result
+{
+    double seconds = 0;
+    std::uint64_t instructions = 0;
+};
+
+/* contexts are cache line aligned already, this also keeps them out of
+   the line pairs that adjacent line prefetchers fetch together */
+struct alignas(128) padded_vm
+{
+    lc3_vm vm;
+};
+
+/* ------------------- counters ------------------- */
+
+/* a counter over this process and every thread started after it opens */
+class counter
+{
+public:
+    counter(std::uint32_t type, std::uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    counter(const counter&) = delete;
+    counter& operator=(const counter&) = delete;
+    ~counter() { if (fd_ >= 0) { close(fd_); } }
+
+    bool available() const noexcept { return fd_ >= 0; }
+
+    /* threads add their counts when they exit, so read after joining them */
+    std::uint64_t read_value() const noexcept
+    {
+        std::uint64_t value = 0;
+        if (fd_ < 0 || read(fd_, &value, sizeof(value)) != sizeof(value)) { return 0; }
+        return value;
+    }
+
+private:
+    int fd_;
+};
+
+/* ------------------- jobs ------------------- */
+
+/* run one guest to HALT, a fault or its budget, yielding to the executor every slice */
+lc3::task run_job(lc3::executor& ex, lc3_vm& vm, const program& p, std::uint64_t budget, std::uint64_t slice,
+    clock_type::time_point start, job_result& result)
+{
+    lc3::string_source in(p.input);
+    char buf[LC3_OUTPUT_MAX];
+    while (vm.instructions < budget)
+    {
+        enum lc3_status status = lc3_run(&vm, std::min(slice, budget - vm.instructions));
+        lc3_read_output(&vm, buf, sizeof(buf));
+        if (status == LC3_HALTED || status == LC3_FAULT) { break; }
+        if (status == LC3_NEED_INPUT)
+        {
+            std::size_t n = in.try_read(std::span<char>(buf, LC3_INPUT_MAX - vm.input_count));
+            if (n == 0) { lc3_close_input(&vm); }
+            lc3_push_input(&vm, buf, n);
+        }
+        else if (status == LC3_BUDGET_EXHAUSTED)
+        {
+            co_await ex.yield();
+        }
+    }
+    result.seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    result.instructions = vm.instructions;
+}
+
+struct options
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t jobs = 256;
+    std::uint64_t budget = 2000000;
+    std::uint64_t slice = 1 << 14;
+    std::uint64_t hitm_event = 0;
+    std::vector<program> programs;
+};
+
+struct measurement
+{
+    double seconds = 0;
+    double mips = 0;
+};
+
+/* one run of every job on threads workers, contexts from vm(i) */
+template <class Context>
+measurement run_round(const options& opt, unsigned threads, const char* layout, Context vm, double base_mips)
+{
+    /* load outside the timed part */
+    for (std::size_t i = 0; i < opt.jobs; ++i)
+    {
+        lc3_init(&vm(i));
+        if (!lc3_load(&vm(i), opt.programs[i % opt.programs.size()].path.c_str()))
+        {
+            std::printf("failed to load image: %s\n", opt.programs[i % opt.programs.size()].path.c_str());
+            std::exit(1);
+        }
+    }
+
+    std::vector<job_result> results(opt.jobs);
+    counter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counter hitm(PERF_TYPE_RAW, opt.hitm_event);
+    lc3::executor::stats stats;
+
+    auto start = clock_type::now();
+    {
+        lc3::executor ex(threads);
+        for (std::size_t i = 0; i < opt.jobs; ++i)
+        {
+            ex.spawn(run_job(ex, vm(i), opt.programs[i % opt.programs.size()], opt.budget, opt.slice, start, results[i]));
+        }
+        ex.wait();
+        stats = ex.statistics();
+    }
+    double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    std::uint64_t instructions = 0;
+    std::vector<double> latency;
+    for (const job_result& r : results)
+    {
+        instructions += r.instructions;
+        latency.push_back(r.seconds * 1e3);
+    }
+    std::sort(latency.begin(), latency.end());
+    auto rank = [&](double p) { return latency[std::min(latency.size() - 1, std::size_t(p / 100 * latency.size()))]; };
+
+    measurement m{ seconds, instructions / seconds / 1e6 };
+    char miss_text[16] = "n/a";
+    char hitm_text[16] = "n/a";
+    if (misses.available()) { std::snprintf(miss_text, sizeof(miss_text), "%.1f", misses.read_value() * 1e6 / instructions); }
+    if (opt.hitm_event && hitm.available()) { std::snprintf(hitm_text, sizeof(hitm_text), "%llu", (unsigned long long)hitm.read_value()); }
+
+    std::printf("%-7s %7u %9.1f %7.2fx %9.2f %9.2f %9.2f %9llu %8llu %7llu %10s %9s\n", layout, threads, m.mips,
+        base_mips > 0 ? m.mips / base_mips : 1.0, rank(50), rank(99), latency.back(),
+        (unsigned long long)stats.resumed, (unsigned long long)stats.stolen, (unsigned long long)stats.slept,
+        miss_text, hitm_text);
+    std::fflush(stdout);
+
+    for (std::size_t i = 0; i < opt.jobs; ++i) { lc3_free(&vm(i)); }
+    return m;
+}
+
+void usage()
+{
+    std::printf("lc3_scaling [-t threads] [-j jobs] [-b budget] [-s slice] [-x hitm_event] [image[=input] ...]\n");
+    std::exit(2);
+}
+
+} /* namespace */
+
+int main(int argc, const char* argv[])
+{
+    options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "-t") == 0 && has_value) { opt.threads = std::max(1, std::atoi(argv[++i])); }
+        else if (std::strcmp(argv[i], "-j") == 0 && has_value) { opt.jobs = std::max(1, std::atoi(argv[++i])); }
+        else if (std::strcmp(argv[i], "-b") == 0 && has_value) { opt.budget = std::strtoull(argv[++i], nullptr, 10); }
+        else if (std::strcmp(argv[i], "-s") == 0 && has_value) { opt.slice = std::max(1ULL, std::strtoull(argv[++i], nullptr, 10)); }
+        else if (std::strcmp(argv[i], "-x") == 0 && has_value) { opt.hitm_event = std::strtoull(argv[++i], nullptr, 0); }
+        else if (argv[i][0] == '-') { usage(); }
+        else
+        {
+            std::string arg = argv[i];
+            std::size_t eq = arg.find('=');
+            opt.programs.push_back({ arg.substr(0, eq), eq == std::string::npos ? "" : arg.substr(eq + 1) });
+        }
+    }
+    if (opt.programs.empty())
+    {
+        opt.programs.push_back({ "games/2048.obj", "ywasdwasdwasdwasdddssaaww" });
+        opt.programs.push_back({ "games/rogue.obj", " ddddssssddddwwwwddddssss" });
+    }
+
+    std::vector<unsigned> counts;
+    for (unsigned t = 1; t < opt.threads; t *= 2) { counts.push_back(t); }
+    counts.push_back(opt.threads);
+
+    std::printf("%zu jobs of up to %llu instructions, %zu byte contexts\n", opt.jobs,
+        (unsigned long long)opt.budget, sizeof(lc3_vm));
+    std::printf("%-7s %7s %9s %8s %9s %9s %9s %9s %8s %7s %10s %9s\n", "layout", "threads", "MIPS", "speedup",
+        "p50 ms", "p99 ms", "max ms", "resumed", "stolen", "slept", "miss/Minst", "hitm");
+
+    std::vector<lc3_vm> packed(opt.jobs);
+    std::vector<padded_vm> padded(opt.jobs);
+    for (const char* layout : { "packed", "padded" })
+    {
+        double base = 0;
+        for (unsigned t : counts)
+        {
+            measurement m = std::strcmp(layout, "packed") == 0
+                ? run_round(opt, t, layout, [&](std::size_t i) -> lc3_vm& { return packed[i]; }, base)
+                : run_round(opt, t, layout, [&](std::size_t i) -> lc3_vm& { return padded[i].vm; }, base);
+            if (t == 1) { base = m.mips; }
+        }
+    }
+    return 0;
+}
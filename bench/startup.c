@@ -0,0 +1,434 @@
+/*
+ * startup and footprint benchmark: creates, loads, runs and frees many
+ * vms on each memory backend and reports the time of every step and the
+ * resident memory each vm costs, then the load time per image size and
+ * the lz16 decode time of a whole memory image.
+ *
+ *   gcc -O2 -o lc3_startup bench/startup.c lc3.c -DLC3_NO_MAIN
+ *   ./lc3_startup [-i image] [-b budget] [-s slice] [-c count,...]
+ *
+ * the vms run round robin, slice instructions at a time, like a host
+ * multiplexing them, and dtlb misses are counted over that phase when
+ * the kernel allows perf counters. counts that would not fit in the
+ * available memory are skipped. the huge page pool keeps memories for
+ * reuse, so later counts on it reuse pages an earlier count made resident.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../lc3.h"
+
+static const char* backend_names[] = { "flat", "sparse", "shared", "huge" };
+
+#define BACKEND_COUNT 4
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* resident bytes of this process, and those not backed by a file. pages
+   of a shared image count in every vm's rss but exist once */
+static void resident(uint64_t* rss, uint64_t* private_rss)
+{
+    unsigned long size = 0, pages = 0, shared = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file)
+    {
+        if (fscanf(file, "%lu %lu %lu", &size, &pages, &shared) != 3) { pages = shared = 0; }
+        fclose(file);
+    }
+    *rss = (uint64_t)pages * sysconf(_SC_PAGESIZE);
+    *private_rss = (uint64_t)(pages - shared) * sysconf(_SC_PAGESIZE);
+}
+
+/* huge page bytes mapped by this process, transparent or hugetlbfs */
+static uint64_t huge_resident()
+{
+    char line[128];
+    unsigned long long kib, total = 0;
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) { return 0; }
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "AnonHugePages: %llu kB", &kib) == 1 || sscanf(line, "Private_Hugetlb: %llu kB", &kib) == 1)
+        {
+            total += kib;
+        }
+    }
+    fclose(file);
+    return total * 1024;
+}
+
+/* data tlb read misses of this thread, -1 when perf counters are unavailable */
+static int open_dtlb_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int dtlb_fd = -1;
+
+/* MemAvailable from /proc/meminfo, 0 when unknown */
+static uint64_t available()
+{
+    char line[128];
+    unsigned long long kib = 0;
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (!file) { return 0; }
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1) { break; }
+    }
+    fclose(file);
+    return kib * 1024;
+}
+
+/* how many mappings a process may have, every shared vm needs its own */
+static uint64_t max_mappings()
+{
+    unsigned long long n = 0;
+    FILE* file = fopen("/proc/sys/vm/max_map_count", "r");
+    if (file)
+    {
+        if (fscanf(file, "%llu", &n) != 1) { n = 0; }
+        fclose(file);
+    }
+    return n;
+}
+
+/* a fresh vm on one backend, loaded with the image */
+static struct lc3_vm* create(int backend, const char* image_path, const struct lc3_image* image)
+{
+    struct lc3_vm* vm = lc3_pool_alloc(1);
+    if (!vm) { return NULL; }
+    int ok = backend == LC3_MEMORY_SHARED ? lc3_init_image(vm, image) : lc3_init_memory(vm, backend);
+    if (ok && backend != LC3_MEMORY_SHARED) { ok = lc3_load(vm, image_path); }
+    if (!ok)
+    {
+        lc3_free(vm);
+        lc3_pool_free(vm, 1);
+        return NULL;
+    }
+    return vm;
+}
+
+/* ------------------- many vms ------------------- */
+
+/* create, load, run and free count vms, returns the private resident
+   bytes per vm or 0 when something failed */
+static uint64_t scale(int backend, uint32_t count, const char* image_path,
+    const struct lc3_image* image, uint64_t budget, uint64_t slice)
+{
+    malloc_trim(0);
+    uint64_t before, private_before;
+    resident(&before, &private_before);
+    uint64_t huge_before = huge_resident();
+
+    /* shared vms are loaded by mapping the image, so their load is in create */
+    double t0 = now();
+    struct lc3_vm* vms = lc3_pool_alloc(count);
+    uint32_t made = 0;
+    while (vms && made < count)
+    {
+        int ok = backend == LC3_MEMORY_SHARED ? lc3_init_image(&vms[made], image) : lc3_init_memory(&vms[made], backend);
+        if (!ok)
+        {
+            lc3_free(&vms[made]);
+            break;
+        }
+        ++made;
+    }
+    double t1 = now();
+    int loaded = made == count;
+    for (uint32_t i = 0; loaded && backend != LC3_MEMORY_SHARED && i < count; ++i)
+    {
+        loaded = lc3_load(&vms[i], image_path);
+    }
+    double t2 = now();
+    char output[LC3_OUTPUT_MAX];
+    uint64_t instructions = 0;
+    /* no input, so a guest waiting for keys runs on instead of returning */
+    for (uint32_t i = 0; loaded && i < count; ++i) { lc3_close_input(&vms[i]); }
+    if (dtlb_fd >= 0)
+    {
+        ioctl(dtlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(dtlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    for (uint64_t round = 0; loaded && round < budget; round += slice)
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            struct lc3_vm* vm = &vms[i];
+            uint64_t end = round + slice < budget ? round + slice : budget;
+            while (!vm->halted && vm->instructions < end)
+            {
+                lc3_run(vm, end - vm->instructions);
+                lc3_read_output(vm, output, sizeof(output));
+            }
+        }
+    }
+    uint64_t dtlb_misses = 0;
+    if (dtlb_fd >= 0)
+    {
+        ioctl(dtlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(dtlb_fd, &dtlb_misses, sizeof(dtlb_misses)) != sizeof(dtlb_misses)) { dtlb_misses = 0; }
+    }
+    for (uint32_t i = 0; loaded && i < count; ++i) { instructions += vms[i].instructions; }
+    double t3 = now();
+    uint64_t after, private_after;
+    resident(&after, &private_after);
+    uint64_t huge_after = huge_resident();
+    for (uint32_t i = 0; i < made; ++i)
+    {
+        lc3_free(&vms[i]);
+    }
+    lc3_pool_free(vms, count);
+    double t4 = now();
+    malloc_trim(0);
+
+    if (!loaded)
+    {
+        printf("%-7s %7u   failed after %u vms\n", backend_names[backend], count, made);
+        return 0;
+    }
+    uint64_t per_vm = after > before ? (after - before) / count : 0;
+    uint64_t private_per_vm = private_after > private_before ? (private_after - private_before) / count : 0;
+    char dtlb[16] = "n/a";
+    if (dtlb_fd >= 0) { snprintf(dtlb, sizeof(dtlb), "%.2f", dtlb_misses * 1e3 / instructions); }
+    printf("%-7s %7u %10.2f %10.2f %10.2f %10.2f %10.1f %10.1f %9llu %12.1f %11s\n", backend_names[backend], count,
+        (t1 - t0) * 1e6 / count, (t2 - t1) * 1e6 / count, (t3 - t2) * 1e6 / count, (t4 - t3) * 1e6 / count,
+        per_vm / 1024.0, private_per_vm / 1024.0,
+        (unsigned long long)((huge_after > huge_before ? huge_after - huge_before : 0) >> 20),
+        instructions / (t3 - t2) / 1e6, dtlb);
+    fflush(stdout);
+    return private_per_vm;
+}
+
+/* ------------------- load time per image size ------------------- */
+
+/* a .obj of words at origin, big endian like the assembler writes them */
+static int write_obj(const char* path, uint16_t origin, uint32_t words)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file) { return 0; }
+    for (uint32_t i = 0; i <= words; ++i)
+    {
+        uint16_t word = i == 0 ? origin : (uint16_t)(i * 0x9E37);
+        fputc(word >> 8, file);
+        fputc(word & 0xFF, file);
+    }
+    return fclose(file) == 0;
+}
+
+#define LOAD_REPS 200
+
+static void load_sizes()
+{
+    static const uint32_t sizes[] = { 256, 4096, 16384, 61440 };
+    char path[] = "/tmp/lc3_startup_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { return; }
+    close(fd);
+
+    printf("\n%-7s %7s %12s %12s\n", "backend", "words", "us/load", "MB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        if (!write_obj(path, 0x1000, sizes[s])) { break; }
+
+        /* the image every shared vm maps */
+        struct lc3_vm* source = create(LC3_MEMORY_FLAT, path, NULL);
+        struct lc3_image* image = source ? lc3_image_create(source) : NULL;
+        if (source)
+        {
+            lc3_free(source);
+            lc3_pool_free(source, 1);
+        }
+
+        for (int backend = 0; backend < BACKEND_COUNT; ++backend)
+        {
+            if (backend == LC3_MEMORY_SHARED && !image) { continue; }
+            double total = 0;
+            for (int r = 0; r < LOAD_REPS; ++r)
+            {
+                struct lc3_vm vm;
+                double t0 = now();
+                int ok;
+                if (backend == LC3_MEMORY_SHARED)
+                {
+                    /* loading is mapping the image, pages come in as the guest runs */
+                    ok = lc3_init_image(&vm, image);
+                }
+                else
+                {
+                    ok = lc3_init_memory(&vm, backend);
+                    t0 = now();
+                    ok = ok && lc3_load(&vm, path);
+                }
+                total += now() - t0;
+                lc3_free(&vm);
+                if (!ok) { break; }
+            }
+            double us = total * 1e6 / LOAD_REPS;
+            printf("%-7s %7u %12.2f %12.1f\n", backend_names[backend], sizes[s], us, sizes[s] * 2 / us);
+        }
+        lc3_image_free(image);
+    }
+    unlink(path);
+}
+
+/* ------------------- lz16 decode time ------------------- */
+
+#define DECODE_REPS 1000
+
+/* compress a whole address space and time decoding it */
+static void decode_time(const char* name, const uint16_t* memory)
+{
+    uint16_t* packed = malloc(lz16_bound(MEMORY_MAX) * sizeof(uint16_t));
+    uint16_t* out = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (packed && out)
+    {
+        uint32_t count = lz16_compress(memory, MEMORY_MAX, packed);
+        int ok = 1;
+        double t0 = now();
+        for (int r = 0; r < DECODE_REPS; ++r)
+        {
+            ok = ok && lz16_decompress(packed, count, out, MEMORY_MAX) == MEMORY_MAX;
+        }
+        double us = (now() - t0) * 1e6 / DECODE_REPS;
+        ok = ok && memcmp(out, memory, MEMORY_MAX * sizeof(uint16_t)) == 0;
+        printf("%-7s %12u %12.2f %12.1f%s\n", name, count, us, MEMORY_MAX * 2 / us, ok ? "" : "  decode failed");
+    }
+    free(packed);
+    free(out);
+}
+
+/* 128 KiB memory images: the loaded image, and incompressible words */
+static void decode_times(const uint16_t* image_memory)
+{
+    printf("\n%-7s %12s %12s %12s\n", "lz16", "packed words", "us/decode", "MB/s");
+    if (image_memory) { decode_time("image", image_memory); }
+    uint16_t* noise = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (!noise) { return; }
+    uint32_t x = 0x9E3779B9;
+    for (uint32_t i = 0; i < MEMORY_MAX; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        noise[i] = (uint16_t)x;
+    }
+    decode_time("random", noise);
+    free(noise);
+}
+
+/* ------------------- main ------------------- */
+
+static void usage()
+{
+    printf("lc3_startup [-i image] [-b budget] [-s slice] [-c count,...]\n");
+    exit(2);
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* image_path = "games/2048.obj";
+    uint64_t budget = 1000;
+    uint64_t slice = 100;
+    uint32_t counts[8] = { 1000, 10000, 100000 };
+    int count_n = 3;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-i") == 0 && has_value) { image_path = argv[++i]; }
+        else if (strcmp(argv[i], "-b") == 0 && has_value) { budget = strtoull(argv[++i], NULL, 10); }
+        else if (strcmp(argv[i], "-s") == 0 && has_value) { slice = strtoull(argv[++i], NULL, 10); }
+        else if (strcmp(argv[i], "-c") == 0 && has_value)
+        {
+            count_n = 0;
+            for (char* p = (char*)argv[++i]; *p && count_n < 8; )
+            {
+                counts[count_n++] = strtoul(p, &p, 10);
+                if (*p == ',') { ++p; }
+            }
+        }
+        else { usage(); }
+    }
+    if (slice == 0) { usage(); }
+    dtlb_fd = open_dtlb_counter();
+
+    struct lc3_vm* source = create(LC3_MEMORY_FLAT, image_path, NULL);
+    if (!source)
+    {
+        printf("failed to load image: %s\n", image_path);
+        return 1;
+    }
+    double t0 = now();
+    struct lc3_image* image = lc3_image_create(source);
+    double t1 = now();
+    uint16_t* image_memory = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (image_memory) { memcpy(image_memory, source->memory, MEMORY_MAX * sizeof(uint16_t)); }
+    lc3_free(source);
+    lc3_pool_free(source, 1);
+
+    printf("image %s, %llu instructions per vm in slices of %llu, struct lc3_vm is %zu bytes\n",
+        image_path, (unsigned long long)budget, (unsigned long long)slice, sizeof(struct lc3_vm));
+    if (image) { printf("shared image created in %.1f us\n", (t1 - t0) * 1e6); }
+    printf("%-7s %7s %10s %10s %10s %10s %10s %10s %9s %12s %11s\n", "backend", "vms", "create us", "load us",
+        "run us", "free us", "rss KiB", "own KiB", "huge MiB", "guest MIPS", "dtlb/Kinst");
+
+    for (int backend = 0; backend < BACKEND_COUNT; ++backend)
+    {
+        if (backend == LC3_MEMORY_SHARED && !image)
+        {
+            printf("%-7s   unavailable, memfd_create failed\n", backend_names[backend]);
+            continue;
+        }
+        /* assume the worst case until a run measured the real cost */
+        uint64_t per_vm = sizeof(struct lc3_vm) + MEMORY_MAX * sizeof(uint16_t);
+        for (int c = 0; c < count_n; ++c)
+        {
+            uint64_t need = per_vm * counts[c];
+            uint64_t free_bytes = available();
+            if (free_bytes && need > free_bytes / 10 * 8)
+            {
+                printf("%-7s %7u   skipped, needs about %llu MiB of %llu available\n", backend_names[backend],
+                    counts[c], (unsigned long long)(need >> 20), (unsigned long long)(free_bytes >> 20));
+                continue;
+            }
+            uint64_t maps = max_mappings();
+            if (backend == LC3_MEMORY_SHARED && maps && counts[c] + 1000 > maps)
+            {
+                printf("%-7s %7u   skipped, vm.max_map_count is %llu\n", backend_names[backend],
+                    counts[c], (unsigned long long)maps);
+                continue;
+            }
+            uint64_t measured = scale(backend, counts[c], image_path, image, budget, slice);
+            if (measured) { per_vm = measured; }
+        }
+    }
+
+    load_sizes();
+    decode_times(image_memory);
+    free(image_memory);
+    lc3_image_free(image);
+    return 0;
+}
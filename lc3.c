@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <signal.h>
+#include <time.h>
 /* unix only */
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,6 +12,62 @@
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/file.h>
+
+#include "lc3.h"
+
+/* ------------------- tracing probes ------------------- */
+
+/*
+ * usdt probes for bpftrace and perf, for example
+ *   bpftrace -e 'usdt:./lc3_vm:lc3:trap { @[arg1] = count(); }'
+ * a probe nobody is tracing is a single nop, and without <sys/sdt.h>
+ * they compile to nothing.
+ *   fetch(vm, pc, instructions)   every PROBE_SAMPLE instructions
+ *   trap(vm, vector, pc)
+ *   mmio_read(vm, address, ready)
+ *   image_load(vm, path, ok)
+ *   halt(vm, pc, instructions)
+ * every probe has a semaphore, which tracers raise while attached. the
+ * interpreter reads fetch's once per slice, so an untraced run does not
+ * even count towards the next sample.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define LC3_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef LC3_HAVE_SDT
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lc3, name, a, b, c)
+#define PROBE_ENABLED(name) __builtin_expect(lc3_##name##_semaphore != 0, 0)
+#define PROBE_SEMAPHORE(name) \
+    unsigned short lc3_##name##_semaphore __attribute__((used, section(".probes")))
+PROBE_SEMAPHORE(fetch);
+PROBE_SEMAPHORE(trap);
+PROBE_SEMAPHORE(mmio_read);
+PROBE_SEMAPHORE(image_load);
+PROBE_SEMAPHORE(halt);
+#else
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE_ENABLED(name) 0
+#endif
+
+/* fetch is sampled at every multiple of this many retired instructions
+   (a power of two), wherever slices start */
+#define PROBE_SAMPLE 4096
 
 /* ------------------- input buffering ------------------- */
 struct termios original_tio;
@@ -40,26 +99,141 @@ uint16_t check_key()
 
 /* ------------------- vm memory ------------------- */
 
-/* memory storage */
-#define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];    /* 65536 locations */
-
-/* registers */
-enum{
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,   /* program counter */
-    R_COND,
-    R_COUNT
+/* registers live in struct lc3_vm (lc3.h), memory comes from a backend */
+#define MEMORY_BYTES (MEMORY_MAX * sizeof(uint16_t))
+
+/* memory of loaded images in a memfd, mapped privately by every vm */
+struct lc3_image
+{
+    int fd;
+    uint16_t pc;
+    int entry_point_set;
+    uint8_t loaded[MEMORY_MAX / 8];
+};
+
+/* host memory in a memfd, mapped shared into vms and the host */
+struct lc3_window
+{
+    int fd;
+    uint32_t words;
+    uint16_t* data;                 /* the host's mapping */
+};
+
+/* a private mapping of fd, or of fresh zero pages when fd is -1 */
+uint16_t* memory_map(int fd, int flags)
+{
+    flags |= fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE : MAP_PRIVATE;
+    void* memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, flags, fd, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+/*
+ * huge page pool: memories are carved 16 to a 2 MiB page, so many vms
+ * cost a handful of tlb entries. pages come from hugetlbfs when the host
+ * reserved some, else from an aligned range advised for transparent huge
+ * pages, which is plain memory when thp is off. released memories are
+ * kept on a free list, pages are never returned.
+ */
+#define HUGE_PAGE (2 << 20)
+
+struct huge_pool
+{
+    char lock;
+    uint8_t* page;                  /* page being carved */
+    uint32_t used;                  /* memories handed out of it */
+    void* free_list;                /* released memories, linked through their first word */
 };
 
-uint16_t reg[R_COUNT];
+struct huge_pool huge_pool;
+
+uint8_t* huge_page()
+{
+    void* page = mmap(NULL, HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (page != MAP_FAILED) { return page; }
+
+    /* thp only backs 2 MiB aligned ranges, trim a larger mapping to one */
+    uint8_t* raw = mmap(NULL, 2 * HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) { return NULL; }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > raw) { munmap(raw, aligned - raw); }
+    munmap(aligned + HUGE_PAGE, raw + HUGE_PAGE - aligned);
+    madvise(aligned, HUGE_PAGE, MADV_HUGEPAGE);
+    return aligned;
+}
+
+uint16_t* huge_alloc()
+{
+    while (__atomic_test_and_set(&huge_pool.lock, __ATOMIC_ACQUIRE)) {}
+    uint16_t* memory = huge_pool.free_list;
+    int reused = memory != NULL;
+    if (reused)
+    {
+        huge_pool.free_list = *(void**)memory;
+    }
+    else
+    {
+        if (!huge_pool.page || huge_pool.used == HUGE_PAGE / MEMORY_BYTES)
+        {
+            huge_pool.page = huge_page();
+            huge_pool.used = 0;
+        }
+        if (huge_pool.page) { memory = (uint16_t*)(huge_pool.page + huge_pool.used++ * MEMORY_BYTES); }
+    }
+    __atomic_clear(&huge_pool.lock, __ATOMIC_RELEASE);
+
+    /* fresh pages are zero, reused memories are not */
+    if (reused) { memset(memory, 0, MEMORY_BYTES); }
+    return memory;
+}
+
+void huge_free(uint16_t* memory)
+{
+    while (__atomic_test_and_set(&huge_pool.lock, __ATOMIC_ACQUIRE)) {}
+    *(void**)memory = huge_pool.free_list;
+    huge_pool.free_list = memory;
+    __atomic_clear(&huge_pool.lock, __ATOMIC_RELEASE);
+}
+
+uint16_t* memory_alloc(enum lc3_memory kind, int fd)
+{
+    switch (kind)
+    {
+        case LC3_MEMORY_FLAT:
+            /* every page now so running never faults */
+            return memory_map(-1, MAP_POPULATE);
+        case LC3_MEMORY_SPARSE:
+            return memory_map(-1, 0);
+        case LC3_MEMORY_SHARED:
+            return fd < 0 ? NULL : memory_map(fd, 0);
+        case LC3_MEMORY_HUGE:
+            return huge_alloc();
+    }
+    return NULL;
+}
+
+/* replace guest pages with the window, unmapped with the rest of memory */
+int memory_map_window(struct lc3_vm* vm, const struct lc3_window* window, uint16_t address)
+{
+    /* huge pages would split, and pool memory outlives the vm */
+    if (vm->memory_kind == LC3_MEMORY_HUGE) { return 0; }
+    void* at = mmap(vm->memory + address, window->words * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED, window->fd, 0);
+    return at != MAP_FAILED;
+}
+
+void memory_release(struct lc3_vm* vm)
+{
+    if (!vm->memory) { return; }
+    if (vm->memory_kind == LC3_MEMORY_HUGE)
+    {
+        huge_free(vm->memory);
+    }
+    else
+    {
+        munmap(vm->memory, MEMORY_BYTES);
+    }
+    vm->memory = NULL;
+}
 
 /* instruction set */
 enum
@@ -105,7 +279,8 @@ enum
 enum
 {
     MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_DBR = LC3_DOORBELL_ADDRESS /* doorbell, stops lc3_run on write */
 };
 
 /* ------------------- utils ------------------- */
@@ -120,19 +295,19 @@ uint16_t sign_extend(uint16_t x, int bit_count)
 }
 
 /* update flags */
-void update_flags(uint16_t r)
+void update_flags(struct lc3_vm* vm, uint16_t r)
 {
-    if (reg[r] == 0)
+    if (vm->reg[r] == 0)
     {
-        reg[R_COND] = FL_ZRO;
+        vm->reg[R_COND] = FL_ZRO;
     }
-    else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+    else if (vm->reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
     {
-        reg[R_COND] = FL_NEG;
+        vm->reg[R_COND] = FL_NEG;
     }
     else
     {
-        reg[R_COND] = FL_POS;
+        vm->reg[R_COND] = FL_POS;
     }
 }
 
@@ -142,417 +317,4533 @@ uint16_t swap16(uint16_t x)
     return (x << 8) | (x >> 8);
 }
 
-/* read image file */
-void read_image_file(FILE* file)
-{
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+/* ------------------- image loading ------------------- */
 
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+/* 0x3000 is the default */
+enum { PC_START = 0x3000 };
 
-    /* swap to little endian */
-    while (read-- > 0)
+/* copy a segment into memory, refusing to overwrite another image */
+int place_segment(struct lc3_vm* vm, uint16_t origin, const uint16_t* words, uint32_t count)
+{
+    if (count > (uint32_t)(MEMORY_MAX - origin)) { return 0; }
+    for (uint32_t a = origin; a < origin + count; ++a)
+    {
+        if (vm->loaded[a >> 3] & (1 << (a & 7)))
+        {
+            printf("image overlaps another image at x%04X\n", a);
+            return 0;
+        }
+    }
+    for (uint32_t a = origin; a < origin + count; ++a)
     {
-        *p = swap16(*p);
-        ++p;
+        vm->loaded[a >> 3] |= 1 << (a & 7);
     }
+    memcpy(vm->memory + origin, words, count * sizeof(uint16_t));
+    return 1;
 }
 
-/* read image */
-int read_image(const char* image_path)
+/* guest symbols, sorted by address, for the profiler and debugger */
+#define SYMBOL_NAME_MAX 32
+struct symbol
 {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
-    return 1;
+    uint16_t address;
+    char name[SYMBOL_NAME_MAX];
+};
+
+struct symbol* symbols = NULL;
+int symbol_count = 0;
+
+/* sort symbols by address */
+int compare_symbols(const void* a, const void* b)
+{
+    return (int)((const struct symbol*)a)->address - (int)((const struct symbol*)b)->address;
 }
 
-/* write in memory */
-void mem_write(uint16_t address, uint16_t val)
+/* record a symbol, keeping the table sorted */
+int add_symbol(uint16_t address, const char* name, size_t len)
 {
-    memory[address] = val;
+    struct symbol* grown = realloc(symbols, (symbol_count + 1) * sizeof(*symbols));
+    if (!grown) { return 0; }
+    symbols = grown;
+    if (len >= SYMBOL_NAME_MAX) { len = SYMBOL_NAME_MAX - 1; }
+    symbols[symbol_count].address = address;
+    memcpy(symbols[symbol_count].name, name, len);
+    symbols[symbol_count].name[len] = 0;
+    ++symbol_count;
+    qsort(symbols, symbol_count, sizeof(*symbols), compare_symbols);
+    return 1;
 }
 
-/* read in memory */
-uint16_t mem_read(uint16_t address)
+/* the symbol at or closest below address, if any */
+const struct symbol* find_symbol(uint16_t address)
 {
-    if (address == MR_KBSR)
+    int lo = 0, hi = symbol_count;
+    while (lo < hi)
     {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
+        int mid = lo + (hi - lo) / 2;
+        if (symbols[mid].address <= address) { lo = mid + 1; } else { hi = mid; }
     }
-    return memory[address];
+    return lo > 0 ? &symbols[lo - 1] : NULL;
 }
 
-/* ------------------- instructions ------------------- */
+/* ------------------- image bundles ------------------- */
 
-/* ADD instruction */
-void addInstr(uint16_t instr){
-    /* destination register (DR) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* first operand (SR1) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* whether we are in immediate mode */
-    uint16_t imm_flag = (instr >> 5) & 0x1;
+/*
+ * a bundle packs many images into one file, already swapped to host order:
+ *   header | index (sorted by name) | image words ...
+ * it is mapped once and images are loaded by name with a single memcpy.
+ */
+#define BUNDLE_MAGIC 0x4233434C /* "LC3B" */
+#define BUNDLE_VERSION 1
+#define BUNDLE_NAME_MAX 32
+#define BUNDLE_CACHE_MAX 16
 
-    if (imm_flag)
+struct bundle_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct bundle_entry
+{
+    char name[BUNDLE_NAME_MAX]; /* nul terminated */
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t offset;            /* from the start of the file, in bytes */
+    uint32_t words;
+    uint32_t reserved2;
+    uint64_t hash;              /* fnv-1a of the words */
+};
+
+struct bundle
+{
+    char path[256];
+    const uint8_t* base;
+    size_t size;
+};
+
+/* bundles stay mapped for the life of the process */
+struct bundle bundles[BUNDLE_CACHE_MAX];
+int bundle_count = 0;
+
+/* 64-bit fnv-1a */
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* p = data;
+    while (size-- > 0)
     {
-        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
+        hash ^= *p++;
+        hash *= 0x100000001B3ULL;
     }
-    else
+    return hash;
+}
+#define FNV1A_INIT 0xCBF29CE484222325ULL
+
+/* map a bundle, or return the mapping we already have */
+const struct bundle* open_bundle(const char* path)
+{
+    for (int i = 0; i < bundle_count; ++i)
     {
-        uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
+        if (strcmp(bundles[i].path, path) == 0) { return &bundles[i]; }
     }
+    if (bundle_count == BUNDLE_CACHE_MAX || strlen(path) >= sizeof(bundles[0].path)) { return NULL; }
 
-    update_flags(r0);
-}
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    off_t size = lseek(fd, 0, SEEK_END);
+    void* base = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) { return NULL; }
 
-/* LDI instruction */
-void ldiInstr(uint16_t instr){
-    /* destination register (DR) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* PCoffset 9*/
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    /* add pc_offset to the current PC, look at that memory location to get the final address */
-    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-    update_flags(r0);
-}
+    /* validate the index once so lookups can trust it */
+    const struct bundle_header* header = base;
+    const struct bundle_entry* index = (const struct bundle_entry*)(header + 1);
+    int valid = (size_t)size >= sizeof(*header)
+        && header->magic == BUNDLE_MAGIC
+        && header->version == BUNDLE_VERSION
+        && header->count <= (size - sizeof(*header)) / sizeof(*index);
+    for (uint32_t i = 0; valid && i < header->count; ++i)
+    {
+        valid = index[i].name[BUNDLE_NAME_MAX - 1] == 0
+            && index[i].words <= (uint32_t)(MEMORY_MAX - index[i].origin)
+            && index[i].offset % sizeof(uint16_t) == 0
+            && index[i].offset <= (uint64_t)size
+            && index[i].words <= (size - index[i].offset) / sizeof(uint16_t);
+    }
+    if (!valid)
+    {
+        munmap(base, size);
+        return NULL;
+    }
 
-/* bitwise and instruction */
-void andInstr(uint16_t instr) {
-    /* extract destination register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* extract first source register (bits 6-8) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* extract immediate flag (bit 5) */
-    uint16_t imm_flag = (instr >> 5) & 0x1;
+    struct bundle* b = &bundles[bundle_count++];
+    strcpy(b->path, path);
+    b->base = base;
+    b->size = size;
+    return b;
+}
 
-    if (imm_flag) {
-        /* sign-extend immediate value (bits 0-4) */
-        uint16_t imm5 = sign_extend(instr & 0x1f, 5);
-        /* perform bitwise and with immediate */
-        reg[r0] = reg[r1] & imm5;
-    } else {
-        /* extract second source register (bits 0-2) */
-        uint16_t r2 = instr & 0x7;
-        /* perform bitwise and with register values */
-        reg[r0] = reg[r1] & reg[r2];
+/* find an image in a bundle by name (the index is sorted) */
+const struct bundle_entry* find_bundle_entry(const struct bundle* b, const char* name)
+{
+    const struct bundle_header* header = (const struct bundle_header*)b->base;
+    const struct bundle_entry* index = (const struct bundle_entry*)(header + 1);
+    uint32_t lo = 0, hi = header->count;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, index[mid].name);
+        if (cmp == 0) { return &index[mid]; }
+        if (cmp < 0) { hi = mid; } else { lo = mid + 1; }
     }
-    /* update condition flags based on result */
-    update_flags(r0);
+    return NULL;
 }
 
-/* bitwise not instruction */
-void notInstr(uint16_t instr) {
-    /* extract destination register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* extract source register (bits 6-8) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* perform bitwise not operation */
-    reg[r0] = ~reg[r1];
-    /* update condition flags based on result */
-    update_flags(r0);
-}
+/* load "bundle-file:image-name" */
+int read_bundle_image(struct lc3_vm* vm, const char* spec)
+{
+    const char* sep = strrchr(spec, ':');
+    if (!sep) { return 0; }
 
-/* branch instruction */
-void brInstr(uint16_t instr) {
-    /* sign-extend pc offset (bits 0-8) */
-    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-    /* extract condition flags (bits 9-11) */
-    uint16_t cond_flag = (instr >> 9) & 0x7;
+    char path[256];
+    size_t len = sep - spec;
+    if (len >= sizeof(path)) { return 0; }
+    memcpy(path, spec, len);
+    path[len] = 0;
 
-    /* check if condition flag matches */
-    if (cond_flag & reg[R_COND]) {
-        /* update program counter with offset */
-        reg[R_PC] += pc_offset;
-    }
+    const struct bundle* b = open_bundle(path);
+    if (!b) { return 0; }
+    const struct bundle_entry* e = find_bundle_entry(b, sep + 1);
+    if (!e) { return 0; }
+
+    /* the words are already in host order */
+    const uint16_t* words = (const uint16_t*)(b->base + e->offset);
+    if (fnv1a(words, e->words * sizeof(uint16_t), FNV1A_INIT) != e->hash) { return 0; }
+    return place_segment(vm, e->origin, words, e->words);
 }
 
-/* jump instruction (also handles ret) */
-void jmpInstr(uint16_t instr) {
-    /* extract source register (bits 6-8) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* set program counter to value in source register */
-    reg[R_PC] = reg[r1];
+/* sort the index by name */
+int compare_bundle_entries(const void* a, const void* b)
+{
+    return strcmp(((const struct bundle_entry*)a)->name, ((const struct bundle_entry*)b)->name);
 }
 
-/* jump register instruction */
-void jsrInstr(uint16_t instr) {
-    /* extract long flag (bit 11) */
-    uint16_t long_flag = (instr >> 11) & 1;
-    /* save current program counter in r7 */
-    reg[R_R7] = reg[R_PC];
+/* write a bundle of .obj images, each named after its file */
+int write_bundle(const char* out_path, const char** image_paths, int count)
+{
+    struct bundle_entry* index = calloc(count, sizeof(*index));
+    uint16_t** images = calloc(count, sizeof(*images));
+    uint32_t offset = sizeof(struct bundle_header) + count * sizeof(*index);
+    int ok = index && images;
 
-    if (long_flag) {
-        /* sign-extend pc offset (bits 0-10) */
-        uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
-        /* update pc with offset (jsr) */
-        reg[R_PC] += long_pc_offset;
-    } else {
-        /* extract source register (bits 6-8) */
-        uint16_t r1 = (instr >> 6) & 0x7;
-        /* set pc to value in source register (jsrr) */
-        reg[R_PC] = reg[r1];
+    for (int i = 0; ok && i < count; ++i)
+    {
+        const char* name = strrchr(image_paths[i], '/');
+        name = name ? name + 1 : image_paths[i];
+        FILE* file = fopen(image_paths[i], "rb");
+        images[i] = malloc(MEMORY_MAX * sizeof(uint16_t));
+        ok = file && images[i] && strlen(name) < BUNDLE_NAME_MAX
+            && fread(&index[i].origin, sizeof(uint16_t), 1, file) == 1;
+        if (ok)
+        {
+            index[i].origin = swap16(index[i].origin);
+            index[i].words = fread(images[i], sizeof(uint16_t), MEMORY_MAX - index[i].origin, file);
+            for (uint32_t w = 0; w < index[i].words; ++w)
+            {
+                images[i][w] = swap16(images[i][w]);
+            }
+            strcpy(index[i].name, name);
+            index[i].offset = offset;
+            index[i].hash = fnv1a(images[i], index[i].words * sizeof(uint16_t), FNV1A_INIT);
+            offset += index[i].words * sizeof(uint16_t);
+        }
+        else
+        {
+            printf("cannot bundle image: %s\n", image_paths[i]);
+        }
+        if (file) { fclose(file); }
     }
-}
 
-/* load instruction */
-void ldInstr(uint16_t instr) {
-    /* extract destination register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* sign-extend pc offset (bits 0-8) */
-    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-    /* read memory at pc + offset into destination register */
-    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-    /* update condition flags based on result */
-    update_flags(r0);
-}
+    /* the index is sorted but the data keeps argument order */
+    struct bundle_entry* sorted = ok ? malloc(count * sizeof(*index)) : NULL;
+    if (sorted)
+    {
+        memcpy(sorted, index, count * sizeof(*index));
+        qsort(sorted, count, sizeof(*sorted), compare_bundle_entries);
+        for (int i = 1; i < count; ++i)
+        {
+            if (strcmp(sorted[i - 1].name, sorted[i].name) == 0)
+            {
+                printf("duplicate image name: %s\n", sorted[i].name);
+                ok = 0;
+            }
+        }
+    }
 
-/* load register instruction */
-void ldrInstr(uint16_t instr) {
-    /* extract destination register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* extract base register (bits 6-8) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* sign-extend offset (bits 0-5) */
-    uint16_t offset = sign_extend(instr & 0x3f, 6);
-    /* read memory at base register + offset into destination register */
-    reg[r0] = mem_read(reg[r1] + offset);
-    /* update condition flags based on result */
-    update_flags(r0);
-}
+    FILE* out = ok && sorted ? fopen(out_path, "wb") : NULL;
+    if (out)
+    {
+        struct bundle_header header = { BUNDLE_MAGIC, BUNDLE_VERSION, count, 0 };
+        ok = fwrite(&header, sizeof(header), 1, out) == 1
+            && fwrite(sorted, sizeof(*sorted), count, out) == (size_t)count;
+        for (int i = 0; ok && i < count; ++i)
+        {
+            ok = fwrite(images[i], sizeof(uint16_t), index[i].words, out) == index[i].words;
+        }
+        ok = fclose(out) == 0 && ok;
+    }
+    else
+    {
+        ok = 0;
+    }
 
-/* load effective address instruction */
-void leaInstr(uint16_t instr) {
-    /* extract destination register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* sign-extend pc offset (bits 0-8) */
-    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-    /* set destination register to pc + offset */
-    reg[r0] = reg[R_PC] + pc_offset;
-    /* update condition flags based on result */
-    update_flags(r0);
+    for (int i = 0; images && i < count; ++i) { free(images[i]); }
+    free(images);
+    free(index);
+    free(sorted);
+    return ok;
 }
 
-/* store instruction */
-void stInstr(uint16_t instr) {
-    /* extract source register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* sign-extend pc offset (bits 0-8) */
-    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-    /* write value in source register to memory at pc + offset */
-    mem_write(reg[R_PC] + pc_offset, reg[r0]);
-}
+/* ------------------- compression ------------------- */
 
-/* store indirect instruction */
-void stiInstr(uint16_t instr) {
-    /* extract source register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* sign-extend pc offset (bits 0-8) */
-    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
-    /* write value in source register to memory at indirect address */
-    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+/*
+ * lz16 is a compressor for streams of 16-bit words, which in images,
+ * memory dumps and traces are mostly zero or repeated. the stream is a
+ * sequence of tokens, each a word whose top two bits give its kind and
+ * whose low 14 bits give a length in words:
+ *   00 literal  the next n words are copied as is
+ *   01 zeros    n zero words
+ *   10 match    the next word is a distance d, copy n words from d back
+ */
+#define LZ16_LITERAL 0x0000
+#define LZ16_ZEROS   0x4000
+#define LZ16_MATCH   0x8000
+#define LZ16_KIND    0xC000
+#define LZ16_LEN_MAX 0x3FFF
+#define LZ16_MIN_MATCH 3
+#define LZ16_HASH_BITS 12
+
+/* largest compressed size of count words (all literals) */
+uint32_t lz16_bound(uint32_t count)
+{
+    return count + count / LZ16_LEN_MAX + 1;
 }
 
-/* store register instruction */
-void strInstr(uint16_t instr) {
-    /* extract source register (bits 9-11) */
-    uint16_t r0 = (instr >> 9) & 0x7;
-    /* extract base register (bits 6-8) */
-    uint16_t r1 = (instr >> 6) & 0x7;
-    /* sign-extend offset (bits 0-5) */
-    uint16_t offset = sign_extend(instr & 0x3f, 6);
-    /* write value in source register to memory at base register + offset */
-    mem_write(reg[r1] + offset, reg[r0]);
+/* flush pending literals before a zero run or match */
+uint32_t lz16_literals(const uint16_t* in, uint32_t start, uint32_t end, uint16_t* out, uint32_t o)
+{
+    while (start < end)
+    {
+        uint32_t n = end - start < LZ16_LEN_MAX ? end - start : LZ16_LEN_MAX;
+        out[o++] = LZ16_LITERAL | n;
+        memcpy(out + o, in + start, n * sizeof(uint16_t));
+        o += n;
+        start += n;
+    }
+    return o;
 }
 
-/* trap instruction */
-void trapInstr(uint16_t instr, int *running){
-    /* save the program counter in r7*/
-    reg[R_R7] = reg[R_PC];
+/* compress count words into out, which holds lz16_bound(count) words */
+uint32_t lz16_compress(const uint16_t* in, uint32_t count, uint16_t* out)
+{
+    /* last position of each hashed pair of words */
+    uint32_t table[1 << LZ16_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
 
-    switch (instr & 0xFF)
+    uint32_t o = 0, literal = 0, i = 0;
+    while (i < count)
     {
-        case TRAP_GETC:
+        /* zero runs, two zeros already pay for the token */
+        uint32_t n = 0;
+        while (i + n < count && n < LZ16_LEN_MAX && in[i + n] == 0) { ++n; }
+        if (n >= 2)
+        {
+            o = lz16_literals(in, literal, i, out, o);
+            out[o++] = LZ16_ZEROS | n;
+            i += n;
+            literal = i;
+            continue;
+        }
+
+        /* matches against the previous occurrence of these two words */
+        if (i + LZ16_MIN_MATCH <= count)
+        {
+            uint32_t h = ((uint32_t)in[i] << 16 | in[i + 1]) * 2654435761u >> (32 - LZ16_HASH_BITS);
+            uint32_t candidate = table[h];
+            table[h] = i;
+            if (candidate != 0xFFFFFFFF && i - candidate <= 0xFFFF)
             {
-                /* read a single ASCII char */
-                reg[R_R0] = (uint16_t)getchar();
-                update_flags(R_R0);
+                n = 0;
+                while (i + n < count && n < LZ16_LEN_MAX && in[candidate + n] == in[i + n]) { ++n; }
+                if (n >= LZ16_MIN_MATCH)
+                {
+                    o = lz16_literals(in, literal, i, out, o);
+                    out[o++] = LZ16_MATCH | n;
+                    out[o++] = i - candidate;
+                    i += n;
+                    literal = i;
+                    continue;
+                }
             }
-            break;
-        case TRAP_OUT:
+        }
+        ++i;
+    }
+    return lz16_literals(in, literal, count, out, o);
+}
+
+/* decompress into out (at most max words), returns the words written or LZ16_ERROR */
+uint32_t lz16_decompress(const uint16_t* in, uint32_t count, uint16_t* out, uint32_t max)
+{
+    uint32_t i = 0, o = 0;
+    while (i < count)
+    {
+        uint16_t token = in[i++];
+        uint32_t n = token & LZ16_LEN_MAX;
+        if (n > max - o) { return LZ16_ERROR; }
+
+        /* whole runs go through memcpy/memset, which the libc vectorizes */
+        switch (token & LZ16_KIND)
+        {
+            case LZ16_LITERAL:
+                if (n > count - i) { return LZ16_ERROR; }
+                memcpy(out + o, in + i, n * sizeof(uint16_t));
+                i += n;
+                break;
+            case LZ16_ZEROS:
+                memset(out + o, 0, n * sizeof(uint16_t));
+                break;
+            case LZ16_MATCH:
+                {
+                    if (i == count) { return LZ16_ERROR; }
+                    uint32_t distance = in[i++];
+                    if (distance == 0 || distance > o) { return LZ16_ERROR; }
+                    const uint16_t* from = out + o - distance;
+                    if (distance >= n)
+                    {
+                        memcpy(out + o, from, n * sizeof(uint16_t));
+                    }
+                    else
+                    {
+                        /* overlapping copy repeats the last distance words */
+                        for (uint32_t k = 0; k < n; ++k) { out[o + k] = from[k]; }
+                    }
+                }
+                break;
+            default:
+                return LZ16_ERROR;
+        }
+        o += n;
+    }
+    return o;
+}
+
+/* ------------------- extended images ------------------- */
+
+/*
+ * an extended image is a versioned container, big endian like .obj:
+ *   header   "LC3X" | version:16 | entry:16 | segments:16 | symbols:16 | checksum:64
+ *   segment  origin:16 | flags:16 | words:32 | words ...
+ *            (with XSEGMENT_LZ16 in flags the words are an lz16 stream)
+ *   symbol   address:16 | length:16 | name bytes ...
+ * the checksum is fnv-1a over everything after the header.
+ */
+#define XIMAGE_MAGIC "LC3X"
+#define XIMAGE_VERSION 1
+#define XIMAGE_HEADER_SIZE 20
+#define XSEGMENT_LZ16 0x1
+
+/* big endian helpers */
+uint16_t get_be16(const uint8_t* p) { return (uint16_t)(p[0] << 8 | p[1]); }
+uint32_t get_be32(const uint8_t* p) { return (uint32_t)get_be16(p) << 16 | get_be16(p + 2); }
+uint64_t get_be64(const uint8_t* p) { return (uint64_t)get_be32(p) << 32 | get_be32(p + 4); }
+void put_be16(FILE* f, uint16_t x) { putc(x >> 8, f); putc(x & 0xFF, f); }
+void put_be32(FILE* f, uint32_t x) { put_be16(f, x >> 16); put_be16(f, x & 0xFFFF); }
+void put_be64(FILE* f, uint64_t x) { put_be32(f, x >> 32); put_be32(f, x & 0xFFFFFFFF); }
+
+/* load an extended image held in buf */
+int read_ximage(struct lc3_vm* vm, const uint8_t* buf, size_t size)
+{
+    if (size < XIMAGE_HEADER_SIZE || get_be16(buf + 4) != XIMAGE_VERSION) { return 0; }
+    uint16_t entry = get_be16(buf + 6);
+    uint16_t segments = get_be16(buf + 8);
+    uint16_t symbol_total = get_be16(buf + 10);
+    if (fnv1a(buf + XIMAGE_HEADER_SIZE, size - XIMAGE_HEADER_SIZE, FNV1A_INIT) != get_be64(buf + 12))
+    {
+        printf("image checksum mismatch\n");
+        return 0;
+    }
+
+    const uint8_t* p = buf + XIMAGE_HEADER_SIZE;
+    const uint8_t* end = buf + size;
+    uint16_t* words = malloc(2 * MEMORY_MAX * sizeof(uint16_t));
+    uint16_t* unpacked = words + MEMORY_MAX;
+    int ok = words != NULL;
+    for (uint16_t i = 0; ok && i < segments; ++i)
+    {
+        ok = end - p >= 8;
+        uint16_t origin = ok ? get_be16(p) : 0;
+        uint16_t flags = ok ? get_be16(p + 2) : 0;
+        uint32_t count = ok ? get_be32(p + 4) : 0;
+        ok = ok && count <= (uint32_t)(MEMORY_MAX - origin) && (size_t)(end - p - 8) / 2 >= count;
+        if (ok)
+        {
+            p += 8;
+            for (uint32_t w = 0; w < count; ++w, p += 2)
+            {
+                words[w] = get_be16(p);
+            }
+            if (flags & XSEGMENT_LZ16)
+            {
+                count = lz16_decompress(words, count, unpacked, MEMORY_MAX - origin);
+                ok = count != LZ16_ERROR && place_segment(vm, origin, unpacked, count);
+            }
+            else
+            {
+                ok = place_segment(vm, origin, words, count);
+            }
+        }
+    }
+    free(words);
+
+    for (uint16_t i = 0; ok && i < symbol_total; ++i)
+    {
+        ok = end - p >= 4 && end - p - 4 >= get_be16(p + 2)
+            && add_symbol(get_be16(p), (const char*)p + 4, get_be16(p + 2));
+        if (ok) { p += 4 + get_be16(p + 2); }
+    }
+
+    /* the first image naming an entry point sets where execution starts */
+    if (ok && !vm->entry_point_set)
+    {
+        vm->reg[R_PC] = entry;
+        vm->entry_point_set = 1;
+    }
+    return ok;
+}
+
+/* parse the symbols of an lc3as .sym file next to an .obj file */
+void read_sym_file(const char* obj_path, struct symbol** syms, int* count)
+{
+    char path[512];
+    size_t len = strlen(obj_path);
+    const char* dot = strrchr(obj_path, '.');
+    if (dot && !strchr(dot, '/')) { len = dot - obj_path; }
+    if (len + 5 > sizeof(path)) { return; }
+    memcpy(path, obj_path, len);
+    strcpy(path + len, ".sym");
+
+    FILE* file = fopen(path, "r");
+    if (!file) { return; }
+    char line[256];
+    char name[SYMBOL_NAME_MAX];
+    unsigned int address;
+    while (fgets(line, sizeof(line), file))
+    {
+        /* entries look like "//\tNAME  3000" */
+        if (sscanf(line, "//%31s %x", name, &address) != 2 || address >= MEMORY_MAX) { continue; }
+        struct symbol* grown = realloc(*syms, (*count + 1) * sizeof(**syms));
+        if (!grown) { break; }
+        *syms = grown;
+        (*syms)[*count].address = address;
+        strcpy((*syms)[*count].name, name);
+        ++*count;
+    }
+    fclose(file);
+}
+
+/* link .obj images (and their .sym files) into one extended image */
+int write_ximage(const char* out_path, int has_entry, uint16_t entry, const char** image_paths, int count)
+{
+    FILE* out = fopen(out_path, "wb+");
+    if (!out) { return 0; }
+
+    /* the header is written last, once the checksum is known */
+    fseek(out, XIMAGE_HEADER_SIZE, SEEK_SET);
+    struct symbol* syms = NULL;
+    int sym_count = 0;
+    uint16_t* words = malloc(MEMORY_MAX * sizeof(uint16_t));
+    uint16_t* packed = malloc(lz16_bound(MEMORY_MAX) * sizeof(uint16_t));
+    int ok = words && packed;
+    for (int i = 0; ok && i < count; ++i)
+    {
+        FILE* file = fopen(image_paths[i], "rb");
+        uint16_t origin;
+        ok = file && fread(&origin, sizeof(origin), 1, file) == 1;
+        if (ok)
+        {
+            origin = swap16(origin);
+            uint32_t n = fread(words, sizeof(uint16_t), MEMORY_MAX - origin, file);
+            if (!has_entry)
+            {
+                entry = origin;
+                has_entry = 1;
+            }
+            for (uint32_t w = 0; w < n; ++w)
+            {
+                words[w] = swap16(words[w]);
+            }
+
+            /* store the segment compressed when that is smaller */
+            uint32_t packed_count = lz16_compress(words, n, packed);
+            int compressed = packed_count < n;
+            const uint16_t* stored = compressed ? packed : words;
+            uint32_t stored_count = compressed ? packed_count : n;
+            put_be16(out, origin);
+            put_be16(out, compressed ? XSEGMENT_LZ16 : 0);
+            put_be32(out, stored_count);
+            for (uint32_t w = 0; w < stored_count; ++w)
+            {
+                put_be16(out, stored[w]);
+            }
+            ok = !ferror(out);
+            read_sym_file(image_paths[i], &syms, &sym_count);
+        }
+        else
+        {
+            printf("cannot link image: %s\n", image_paths[i]);
+        }
+        if (file) { fclose(file); }
+    }
+    for (int i = 0; ok && i < sym_count; ++i)
+    {
+        put_be16(out, syms[i].address);
+        put_be16(out, strlen(syms[i].name));
+        fputs(syms[i].name, out);
+    }
+    free(words);
+    free(packed);
+    free(syms);
+
+    /* checksum the body and fill in the header */
+    uint64_t hash = FNV1A_INIT;
+    uint8_t chunk[4096];
+    size_t n;
+    ok = ok && fflush(out) == 0 && fseek(out, XIMAGE_HEADER_SIZE, SEEK_SET) == 0;
+    while (ok && (n = fread(chunk, 1, sizeof(chunk), out)) > 0)
+    {
+        hash = fnv1a(chunk, n, hash);
+    }
+    if (ok && fseek(out, 0, SEEK_SET) == 0)
+    {
+        fputs(XIMAGE_MAGIC, out);
+        put_be16(out, XIMAGE_VERSION);
+        put_be16(out, entry);
+        put_be16(out, count);
+        put_be16(out, sym_count);
+        put_be64(out, hash);
+    }
+    return fclose(out) == 0 && ok;
+}
+
+/* read image file, either an extended image or a plain .obj */
+int read_image_file(struct lc3_vm* vm, FILE* file)
+{
+    /* we know the maximum file size */
+    size_t max_size = 1 << 20;
+    uint8_t* buf = malloc(max_size);
+    if (!buf) { return 0; }
+    size_t size = fread(buf, 1, max_size, file);
+
+    int ok;
+    if (size >= 4 && memcmp(buf, XIMAGE_MAGIC, 4) == 0)
+    {
+        ok = read_ximage(vm, buf, size);
+    }
+    else
+    {
+        /* the origin tells us where in memory to place the image */
+        ok = size >= 2;
+        uint16_t origin = ok ? get_be16(buf) : 0;
+        uint32_t count = (size - 2) / 2;
+        if (count > (uint32_t)(MEMORY_MAX - origin)) { count = MEMORY_MAX - origin; }
+
+        /* swap to little endian */
+        uint16_t* p = (uint16_t*)buf;
+        for (uint32_t i = 0; ok && i < count; ++i)
+        {
+            p[i] = get_be16(buf + 2 + 2 * i);
+        }
+        ok = ok && place_segment(vm, origin, p, count);
+    }
+    free(buf);
+    return ok;
+}
+
+/* read image */
+int read_image(struct lc3_vm* vm, const char* image_path)
+{
+    FILE* file = fopen(image_path, "rb");
+    /* not a file, maybe an image inside a bundle */
+    if (!file) { return read_bundle_image(vm, image_path); };
+    int ok = read_image_file(vm, file);
+    fclose(file);
+    return ok;
+}
+
+/* pop a queued key, EOF when the input is closed and empty */
+uint16_t next_input(struct lc3_vm* vm)
+{
+    if (vm->input_count == 0) { return 0xFFFF; }
+    uint8_t c = vm->input[vm->input_head];
+    vm->input_head = (vm->input_head + 1) % LC3_INPUT_MAX;
+    --vm->input_count;
+    return c;
+}
+
+/* whether a read would have to wait for the host */
+int input_blocked(struct lc3_vm* vm)
+{
+    return vm->input_count == 0 && !vm->input_closed;
+}
+
+/* append console output, returns 0 when it does not fit */
+int emit(struct lc3_vm* vm, const char* text, uint32_t size)
+{
+    if (size > LC3_OUTPUT_MAX - vm->output_len) { return 0; }
+    memcpy(vm->output + vm->output_len, text, size);
+    vm->output_len += size;
+    return 1;
+}
+
+/* ------------------- memory heatmap ------------------- */
+
+#define HEAT_PAGE_BITS 8
+#define HEAT_PAGES (MEMORY_MAX >> HEAT_PAGE_BITS)
+
+enum { HEAT_READ = 0, HEAT_WRITE, HEAT_EXEC, HEAT_KINDS };
+
+struct lc3_heatmap
+{
+    uint64_t counts[HEAT_KINDS][HEAT_PAGES];
+    uint32_t window_length;             /* instructions per window */
+    uint32_t window_left;
+    uint64_t fetches;
+    uint64_t touched[HEAT_PAGES / 64];  /* pages used in the current window */
+    uint16_t* windows;                  /* pages used in each closed window */
+    uint32_t window_count;
+    uint32_t window_capacity;
+};
+
+/* pages used so far in the current window */
+uint16_t heat_pages(const struct lc3_heatmap* h)
+{
+    uint16_t pages = 0;
+    for (int i = 0; i < HEAT_PAGES / 64; ++i) { pages += __builtin_popcountll(h->touched[i]); }
+    return pages;
+}
+
+/* whether the current window has seen any instruction yet */
+int heat_partial(const struct lc3_heatmap* h)
+{
+    return h->window_left < h->window_length;
+}
+
+/* close the current window and start the next one */
+void heat_window(struct lc3_heatmap* h)
+{
+    uint16_t pages = heat_pages(h);
+    memset(h->touched, 0, sizeof(h->touched));
+    if (h->window_count == h->window_capacity)
+    {
+        uint32_t capacity = h->window_capacity ? 2 * h->window_capacity : 1024;
+        uint16_t* grown = realloc(h->windows, capacity * sizeof(*grown));
+        if (!grown) { return; }
+        h->windows = grown;
+        h->window_capacity = capacity;
+    }
+    h->windows[h->window_count++] = pages;
+}
+
+/* record one access */
+void heat_touch(struct lc3_heatmap* h, uint16_t address, int kind)
+{
+    uint16_t page = address >> HEAT_PAGE_BITS;
+    ++h->counts[kind][page];
+    h->touched[page >> 6] |= 1ULL << (page & 63);
+    if (kind == HEAT_EXEC)
+    {
+        ++h->fetches;
+        if (--h->window_left == 0)
+        {
+            heat_window(h);
+            h->window_left = h->window_length;
+        }
+    }
+}
+
+int lc3_heatmap_enable(struct lc3_vm* vm, uint32_t window_length)
+{
+    if (vm->heatmap) { return 1; }
+    vm->heatmap = calloc(1, sizeof(*vm->heatmap));
+    if (!vm->heatmap) { return 0; }
+    vm->heatmap->window_length = window_length ? window_length : 1;
+    vm->heatmap->window_left = vm->heatmap->window_length;
+    return 1;
+}
+
+void lc3_heatmap_free(struct lc3_vm* vm)
+{
+    if (!vm->heatmap) { return; }
+    free(vm->heatmap->windows);
+    free(vm->heatmap);
+    vm->heatmap = NULL;
+}
+
+void lc3_heatmap_write_csv(struct lc3_vm* vm, FILE* out)
+{
+    struct lc3_heatmap* h = vm->heatmap;
+    if (!h) { return; }
+    fprintf(out, "page,address,reads,writes,executes\n");
+    for (int page = 0; page < HEAT_PAGES; ++page)
+    {
+        fprintf(out, "%d,x%04X,%llu,%llu,%llu\n", page, page << HEAT_PAGE_BITS,
+            (unsigned long long)h->counts[HEAT_READ][page],
+            (unsigned long long)h->counts[HEAT_WRITE][page],
+            (unsigned long long)h->counts[HEAT_EXEC][page]);
+    }
+}
+
+void lc3_heatmap_write_windows(struct lc3_vm* vm, FILE* out)
+{
+    struct lc3_heatmap* h = vm->heatmap;
+    if (!h) { return; }
+    fprintf(out, "window,first_instruction,pages,words\n");
+    for (uint32_t i = 0; i < h->window_count; ++i)
+    {
+        fprintf(out, "%u,%llu,%u,%u\n", i, (unsigned long long)i * h->window_length,
+            h->windows[i], (unsigned)h->windows[i] << HEAT_PAGE_BITS);
+    }
+    /* the window still open when the run stopped */
+    if (heat_partial(h))
+    {
+        uint16_t pages = heat_pages(h);
+        fprintf(out, "%u,%llu,%u,%u\n", h->window_count, (unsigned long long)h->window_count * h->window_length,
+            pages, (unsigned)pages << HEAT_PAGE_BITS);
+    }
+}
+
+/* log2(x) in sixteenths, x > 0, precise enough for shading */
+uint32_t log2_16(uint64_t x)
+{
+    int bits = 63 - __builtin_clzll(x);
+    uint32_t fraction = bits >= 4 ? (x >> (bits - 4)) & 15 : (x << (4 - bits)) & 15;
+    return bits * 16 + fraction;
+}
+
+/* 0..255 on a log scale relative to the busiest page */
+uint8_t heat_level(uint64_t count, uint64_t max)
+{
+    if (count == 0 || max == 0) { return 0; }
+    uint32_t level = 255 * log2_16(count + 1) / log2_16(max + 1);
+    return level < 1 ? 1 : level;
+}
+
+/* the busiest page of one kind */
+uint64_t heat_max(struct lc3_heatmap* h, int kind)
+{
+    uint64_t max = 0;
+    for (int page = 0; page < HEAT_PAGES; ++page)
+    {
+        if (h->counts[kind][page] > max) { max = h->counts[kind][page]; }
+    }
+    return max;
+}
+
+void lc3_heatmap_write_ppm(struct lc3_vm* vm, FILE* out)
+{
+    struct lc3_heatmap* h = vm->heatmap;
+    if (!h) { return; }
+    uint64_t max[HEAT_KINDS];
+    for (int kind = 0; kind < HEAT_KINDS; ++kind) { max[kind] = heat_max(h, kind); }
+
+    /* pages run left to right, top to bottom, 16 to a row */
+    fprintf(out, "P6\n256 256\n255\n");
+    for (int y = 0; y < 256; ++y)
+    {
+        for (int x = 0; x < 256; ++x)
+        {
+            int page = (y / 16) * 16 + x / 16;
+            uint8_t rgb[3] = {
+                heat_level(h->counts[HEAT_WRITE][page], max[HEAT_WRITE]),
+                heat_level(h->counts[HEAT_EXEC][page], max[HEAT_EXEC]),
+                heat_level(h->counts[HEAT_READ][page], max[HEAT_READ]),
+            };
+            fwrite(rgb, 1, 3, out);
+        }
+    }
+}
+
+void lc3_heatmap_write_ascii(struct lc3_vm* vm, FILE* out)
+{
+    struct lc3_heatmap* h = vm->heatmap;
+    if (!h) { return; }
+    const char shades[] = " .:-=+*#%@";
+    uint64_t total[HEAT_PAGES];
+    uint64_t max = 0;
+    for (int page = 0; page < HEAT_PAGES; ++page)
+    {
+        total[page] = h->counts[HEAT_READ][page] + h->counts[HEAT_WRITE][page] + h->counts[HEAT_EXEC][page];
+        if (total[page] > max) { max = total[page]; }
+    }
+
+    fprintf(out, "memory accesses per page (log scale, ' ' none to '@' most)\n");
+    fprintf(out, "      0123456789ABCDEF\n");
+    for (int row = 0; row < 16; ++row)
+    {
+        fprintf(out, "x%X000 ", row);
+        for (int col = 0; col < 16; ++col)
+        {
+            uint8_t level = heat_level(total[row * 16 + col], max);
+            putc(level ? shades[1 + level * (sizeof(shades) - 3) / 255] : ' ', out);
+        }
+        putc('\n', out);
+    }
+
+    /* working set over the windows, the last one may be partial */
+    uint32_t peak = 0;
+    uint64_t sum = 0;
+    uint32_t count = h->window_count;
+    for (uint32_t i = 0; i < h->window_count; ++i)
+    {
+        if (h->windows[i] > peak) { peak = h->windows[i]; }
+        sum += h->windows[i];
+    }
+    if (heat_partial(h))
+    {
+        uint16_t pages = heat_pages(h);
+        if (pages > peak) { peak = pages; }
+        sum += pages;
+        ++count;
+    }
+    fprintf(out, "working set per %u instructions: %u windows, peak %u pages (%.1f KiB), mean %.1f pages\n",
+        h->window_length, count, peak, peak * 2.0 * (1 << HEAT_PAGE_BITS) / 1024,
+        count ? (double)sum / count : 0.0);
+}
+
+/* ------------------- sanitizer ------------------- */
+
+/* shadow bits kept for every word */
+enum
+{
+    SHADOW_INIT = 1 << 0,   /* written or loaded */
+    SHADOW_CODE = 1 << 1,   /* fetched as an instruction */
+    SHADOW_STACK = 1 << 2   /* pushed through R6 */
+};
+
+/* kinds of report, each reported once per PC */
+enum
+{
+    SAN_UNINIT_READ = 0,
+    SAN_UNINIT_FETCH,
+    SAN_CODE_WRITE,
+    SAN_STACK_UNDERFLOW,
+    SAN_STACK_STALE,
+    SAN_KINDS
+};
+
+#define SAN_REPORT_MAX 100
+
+struct lc3_sanitizer
+{
+    uint8_t shadow[MEMORY_MAX];
+    uint64_t reported[SAN_KINDS][MEMORY_MAX / 64];
+    uint32_t stack_base;            /* just above the first push, 0 until then */
+    uint32_t count;
+    FILE* out;
+};
+
+void function_name(uint16_t entry, char* name, size_t size);
+void track_calls(struct lc3_vm* vm);
+
+/* report a problem found by the instruction at pc */
+void san_report(struct lc3_vm* vm, int kind, uint16_t pc, uint16_t address)
+{
+    static const char* what[SAN_KINDS] = {
+        "read of uninitialized memory",
+        "fetch of uninitialized memory",
+        "write over executed code",
+        "stack underflow: R6 read above the stack base",
+        "read below the stack pointer (popped slot)"
+    };
+    struct lc3_sanitizer* san = vm->sanitizer;
+    uint64_t bit = 1ULL << (pc & 63);
+    if (san->reported[kind][pc >> 6] & bit) { return; }
+    san->reported[kind][pc >> 6] |= bit;
+    if (san->count++ >= SAN_REPORT_MAX) { return; }
+
+    fprintf(san->out, "lc3 sanitizer: %s x%04X at pc x%04X\n", what[kind], address, pc);
+    for (uint32_t i = vm->call_depth; i > 0; --i)
+    {
+        char name[SYMBOL_NAME_MAX + 8];
+        function_name(vm->calls[i - 1].entry, name, sizeof(name));
+        fprintf(san->out, "    %s %s (x%04X)\n", i == vm->call_depth ? "in" : "called from",
+            name, vm->calls[i - 1].entry);
+    }
+    if (san->count == SAN_REPORT_MAX) { fprintf(san->out, "lc3 sanitizer: further reports suppressed\n"); }
+}
+
+void san_read(struct lc3_vm* vm, uint16_t address)
+{
+    if (!(vm->sanitizer->shadow[address] & SHADOW_INIT))
+    {
+        san_report(vm, SAN_UNINIT_READ, vm->reg[R_PC] - 1, address);
+    }
+}
+
+void san_write(struct lc3_vm* vm, uint16_t address)
+{
+    uint8_t* shadow = &vm->sanitizer->shadow[address];
+    if (*shadow & SHADOW_CODE) { san_report(vm, SAN_CODE_WRITE, vm->reg[R_PC] - 1, address); }
+    *shadow |= SHADOW_INIT;
+}
+
+void san_fetch(struct lc3_vm* vm, uint16_t address)
+{
+    uint8_t* shadow = &vm->sanitizer->shadow[address];
+    if (!(*shadow & SHADOW_INIT)) { san_report(vm, SAN_UNINIT_FETCH, address, address); }
+    *shadow |= SHADOW_CODE;
+}
+
+/* LDR/STR through R6: pushes grow the stack down from its base */
+void san_stack(struct lc3_vm* vm, uint16_t address, int store)
+{
+    struct lc3_sanitizer* san = vm->sanitizer;
+    if (store)
+    {
+        if (san->stack_base == 0) { san->stack_base = (uint32_t)address + 1; }
+        san->shadow[address] |= SHADOW_STACK;
+        return;
+    }
+    if (san->stack_base != 0 && address >= san->stack_base)
+    {
+        san_report(vm, SAN_STACK_UNDERFLOW, vm->reg[R_PC] - 1, address);
+    }
+    else if (address < vm->reg[R_R6] && (san->shadow[address] & SHADOW_STACK))
+    {
+        san_report(vm, SAN_STACK_STALE, vm->reg[R_PC] - 1, address);
+    }
+}
+
+int lc3_sanitize_enable(struct lc3_vm* vm, FILE* report)
+{
+    if (vm->sanitizer) { return 1; }
+    vm->sanitizer = calloc(1, sizeof(*vm->sanitizer));
+    if (!vm->sanitizer) { return 0; }
+    vm->sanitizer->out = report;
+
+    /* loaded images, windows and device registers start out initialized */
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (vm->loaded[a >> 3] & (1 << (a & 7))) { vm->sanitizer->shadow[a] = SHADOW_INIT; }
+    }
+    vm->sanitizer->shadow[MR_KBSR] = vm->sanitizer->shadow[MR_KBDR] = vm->sanitizer->shadow[MR_DBR] = SHADOW_INIT;
+
+    /* reports name the calling functions */
+    track_calls(vm);
+    return 1;
+}
+
+uint32_t lc3_sanitize_count(struct lc3_vm* vm)
+{
+    return vm->sanitizer ? vm->sanitizer->count : 0;
+}
+
+void lc3_sanitize_free(struct lc3_vm* vm)
+{
+    free(vm->sanitizer);
+    vm->sanitizer = NULL;
+}
+
+/*
+ * the interpreter loop is compiled once per combination of attached tools
+ * (see execute), so a tool that is off costs not even a test. features
+ * is a constant in every copy and the functions it flows through are
+ * always inlined into the loop.
+ */
+enum
+{
+    FEATURE_HEATMAP = 1 << 0,   /* heat_touch on every access */
+    FEATURE_SANITIZE = 1 << 1,  /* shadow memory checks */
+    FEATURE_CALLS = 1 << 2,     /* shadow call stack on JSR and JMP */
+    FEATURE_COMBINATIONS = 1 << 3
+};
+
+#define SPECIALIZED static inline __attribute__((always_inline))
+
+/* write in memory, returns whether that rang the doorbell */
+SPECIALIZED int mem_write(struct lc3_vm* vm, uint16_t address, uint16_t val, unsigned features)
+{
+    if (features & FEATURE_HEATMAP) { heat_touch(vm->heatmap, address, HEAT_WRITE); }
+    if (features & FEATURE_SANITIZE) { san_write(vm, address); }
+    vm->memory[address] = val;
+    return address == MR_DBR;
+}
+
+/* read in memory, device registers included */
+uint16_t mem_access(struct lc3_vm* vm, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        PROBE3(mmio_read, vm, address, vm->input_count > 0);
+        /* never block, only look at the queued input */
+        if (vm->input_count > 0)
+        {
+            vm->memory[MR_KBSR] = (1 << 15);
+            vm->memory[MR_KBDR] = next_input(vm);
+        }
+        else
+        {
+            vm->memory[MR_KBSR] = 0;
+        }
+    }
+    return vm->memory[address];
+}
+
+/* read in memory */
+SPECIALIZED uint16_t mem_read(struct lc3_vm* vm, uint16_t address, unsigned features)
+{
+    if (features & FEATURE_HEATMAP) { heat_touch(vm->heatmap, address, HEAT_READ); }
+    if (features & FEATURE_SANITIZE) { san_read(vm, address); }
+    return mem_access(vm, address);
+}
+
+/* fetch the next instruction */
+SPECIALIZED uint16_t fetch(struct lc3_vm* vm, unsigned features)
+{
+    if (features & FEATURE_HEATMAP) { heat_touch(vm->heatmap, vm->reg[R_PC], HEAT_EXEC); }
+    if (features & FEATURE_SANITIZE) { san_fetch(vm, vm->reg[R_PC]); }
+    return mem_access(vm, vm->reg[R_PC]++);
+}
+
+/* ------------------- faults ------------------- */
+
+/* stop the guest for good and keep its state for the host */
+enum lc3_status set_fault(struct lc3_vm* vm, enum lc3_fault_kind kind, uint16_t pc, uint16_t instr)
+{
+    vm->fault.kind = kind;
+    vm->fault.pc = pc;
+    vm->fault.instr = instr;
+    memcpy(vm->fault.reg, vm->reg, sizeof(vm->fault.reg));
+    vm->fault.reg[R_PC] = pc;
+    vm->halted = 1;
+    return LC3_FAULT;
+}
+
+/* the instruction just fetched faulted, it does not retire */
+enum lc3_status raise_fault(struct lc3_vm* vm, enum lc3_fault_kind kind, uint16_t instr)
+{
+    --vm->reg[R_PC];
+    --vm->instructions;
+    return set_fault(vm, kind, vm->reg[R_PC], instr);
+}
+
+void lc3_set_limit(struct lc3_vm* vm, uint64_t limit)
+{
+    vm->instruction_limit = limit;
+}
+
+int lc3_trap_register(struct lc3_vm* vm, uint8_t vector, lc3_trap_fn fn, void* user)
+{
+    if (!vm->traps)
+    {
+        if (!fn) { return 1; }
+        vm->traps = calloc(256, sizeof(*vm->traps));
+        if (!vm->traps) { return 0; }
+    }
+    vm->traps[vector].fn = fn;
+    vm->traps[vector].user = user;
+    return 1;
+}
+
+const char* fault_name(enum lc3_fault_kind kind)
+{
+    static const char* names[] = {
+        "no fault",
+        "illegal opcode",
+        "privilege violation",
+        "instruction limit reached",
+        "native trap failed",
+    };
+    return kind < sizeof(names) / sizeof(*names) ? names[kind] : "unknown fault";
+}
+
+void lc3_fault_report(const struct lc3_vm* vm, FILE* out)
+{
+    const struct lc3_fault* f = &vm->fault;
+    fprintf(out, "%s at x%04X: x%04X\n", fault_name(f->kind), f->pc, f->instr);
+    for (int r = R_R0; r <= R_R7; ++r)
+    {
+        fprintf(out, "R%d x%04X%s", r, f->reg[r], r == R_R3 || r == R_R7 ? "\n" : "  ");
+    }
+    fprintf(out, "PC x%04X  COND %c\n", f->reg[R_PC],
+        f->reg[R_COND] == FL_NEG ? 'n' : f->reg[R_COND] == FL_ZRO ? 'z' : 'p');
+}
+
+/* ------------------- instructions ------------------- */
+
+/* ADD instruction */
+void addInstr(struct lc3_vm* vm, uint16_t instr){
+    /* destination register (DR) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* first operand (SR1) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* whether we are in immediate mode */
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    if (imm_flag)
+    {
+        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+        vm->reg[r0] = vm->reg[r1] + imm5;
+    }
+    else
+    {
+        uint16_t r2 = instr & 0x7;
+        vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
+    }
+
+    update_flags(vm, r0);
+}
+
+/* LDI instruction */
+SPECIALIZED void ldiInstr(struct lc3_vm* vm, uint16_t instr, unsigned features){
+    /* destination register (DR) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* PCoffset 9*/
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    /* add pc_offset to the current PC, look at that memory location to get the final address */
+    vm->reg[r0] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + pc_offset, features), features);
+    update_flags(vm, r0);
+}
+
+/* bitwise and instruction */
+void andInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* extract destination register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* extract first source register (bits 6-8) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* extract immediate flag (bit 5) */
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    if (imm_flag) {
+        /* sign-extend immediate value (bits 0-4) */
+        uint16_t imm5 = sign_extend(instr & 0x1f, 5);
+        /* perform bitwise and with immediate */
+        vm->reg[r0] = vm->reg[r1] & imm5;
+    } else {
+        /* extract second source register (bits 0-2) */
+        uint16_t r2 = instr & 0x7;
+        /* perform bitwise and with register values */
+        vm->reg[r0] = vm->reg[r1] & vm->reg[r2];
+    }
+    /* update condition flags based on result */
+    update_flags(vm, r0);
+}
+
+/* bitwise not instruction */
+void notInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* extract destination register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* extract source register (bits 6-8) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* perform bitwise not operation */
+    vm->reg[r0] = ~vm->reg[r1];
+    /* update condition flags based on result */
+    update_flags(vm, r0);
+}
+
+/* branch instruction */
+void brInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* sign-extend pc offset (bits 0-8) */
+    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+    /* extract condition flags (bits 9-11) */
+    uint16_t cond_flag = (instr >> 9) & 0x7;
+
+    /* check if condition flag matches */
+    if (cond_flag & vm->reg[R_COND]) {
+        /* update program counter with offset */
+        vm->reg[R_PC] += pc_offset;
+    }
+}
+
+/*
+ * delay loops: ADD Rn,Rn,#imm and a branch back to it that loops while Rn
+ * has not yet crossed zero (BRp/BRzp counting down, BRn/BRnz counting up).
+ * they only change Rn and the flags, so the remaining iterations are done
+ * at once. called once the branch jumped back to the ADD, returns the
+ * instructions used out of left, always whole iterations.
+ */
+uint64_t skip_delay_loop(struct lc3_vm* vm, uint16_t instr, uint64_t left)
+{
+    uint16_t add = vm->memory[vm->reg[R_PC]];
+    uint16_t r = (add >> 9) & 0x7;
+    if ((add & 0xF020) != 0x1020 || ((add >> 6) & 0x7) != r) { return 0; }
+
+    int imm = (int16_t)sign_extend(add & 0x1F, 5);
+    uint16_t loop_on = (instr >> 9) & 0x7;
+    uint16_t sign = imm < 0 ? FL_POS : FL_NEG;
+    if (imm == 0 || (loop_on & ~FL_ZRO) != sign) { return 0; }
+
+    /* distance left to zero, and iterations until Rn leaves the loop range */
+    int step = imm < 0 ? -imm : imm;
+    int distance = imm < 0 ? (int16_t)vm->reg[r] : -(int16_t)vm->reg[r];
+    if (distance < 0) { return 0; }
+    uint64_t iterations = loop_on & FL_ZRO ? distance / step + 1 : (distance + step - 1) / step;
+
+    if (iterations > left / 2) { iterations = left / 2; }
+    /* entered with Rn already out of range, the ADD runs normally */
+    if (iterations == 0) { return 0; }
+    vm->reg[r] += (uint16_t)(iterations * imm);
+    update_flags(vm, r);
+    /* the last BR falls through */
+    if (!(vm->reg[R_COND] & loop_on)) { vm->reg[R_PC] += 2; }
+    return iterations * 2;
+}
+
+/* jump instruction (also handles ret) */
+void jmpInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* extract source register (bits 6-8) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* set program counter to value in source register */
+    vm->reg[R_PC] = vm->reg[r1];
+}
+
+/* jump register instruction */
+void jsrInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* extract long flag (bit 11) */
+    uint16_t long_flag = (instr >> 11) & 1;
+    /* save current program counter in r7 */
+    vm->reg[R_R7] = vm->reg[R_PC];
+
+    if (long_flag) {
+        /* sign-extend pc offset (bits 0-10) */
+        uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
+        /* update pc with offset (jsr) */
+        vm->reg[R_PC] += long_pc_offset;
+    } else {
+        /* extract source register (bits 6-8) */
+        uint16_t r1 = (instr >> 6) & 0x7;
+        /* set pc to value in source register (jsrr) */
+        vm->reg[R_PC] = vm->reg[r1];
+    }
+}
+
+/* load instruction */
+SPECIALIZED void ldInstr(struct lc3_vm* vm, uint16_t instr, unsigned features) {
+    /* extract destination register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* sign-extend pc offset (bits 0-8) */
+    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+    /* read memory at pc + offset into destination register */
+    vm->reg[r0] = mem_read(vm, vm->reg[R_PC] + pc_offset, features);
+    /* update condition flags based on result */
+    update_flags(vm, r0);
+}
+
+/* load register instruction */
+SPECIALIZED void ldrInstr(struct lc3_vm* vm, uint16_t instr, unsigned features) {
+    /* extract destination register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* extract base register (bits 6-8) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* sign-extend offset (bits 0-5) */
+    uint16_t offset = sign_extend(instr & 0x3f, 6);
+    /* stack discipline checks on pops through R6 */
+    if ((features & FEATURE_SANITIZE) && r1 == R_R6) { san_stack(vm, vm->reg[r1] + offset, 0); }
+    /* read memory at base register + offset into destination register */
+    vm->reg[r0] = mem_read(vm, vm->reg[r1] + offset, features);
+    /* update condition flags based on result */
+    update_flags(vm, r0);
+}
+
+/* load effective address instruction */
+void leaInstr(struct lc3_vm* vm, uint16_t instr) {
+    /* extract destination register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* sign-extend pc offset (bits 0-8) */
+    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+    /* set destination register to pc + offset */
+    vm->reg[r0] = vm->reg[R_PC] + pc_offset;
+    /* update condition flags based on result */
+    update_flags(vm, r0);
+}
+
+/* store instruction */
+SPECIALIZED int stInstr(struct lc3_vm* vm, uint16_t instr, unsigned features) {
+    /* extract source register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* sign-extend pc offset (bits 0-8) */
+    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+    /* write value in source register to memory at pc + offset */
+    return mem_write(vm, vm->reg[R_PC] + pc_offset, vm->reg[r0], features);
+}
+
+/* store indirect instruction */
+SPECIALIZED int stiInstr(struct lc3_vm* vm, uint16_t instr, unsigned features) {
+    /* extract source register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* sign-extend pc offset (bits 0-8) */
+    uint16_t pc_offset = sign_extend(instr & 0x1ff, 9);
+    /* write value in source register to memory at indirect address */
+    return mem_write(vm, mem_read(vm, vm->reg[R_PC] + pc_offset, features), vm->reg[r0], features);
+}
+
+/* store register instruction */
+SPECIALIZED int strInstr(struct lc3_vm* vm, uint16_t instr, unsigned features) {
+    /* extract source register (bits 9-11) */
+    uint16_t r0 = (instr >> 9) & 0x7;
+    /* extract base register (bits 6-8) */
+    uint16_t r1 = (instr >> 6) & 0x7;
+    /* sign-extend offset (bits 0-5) */
+    uint16_t offset = sign_extend(instr & 0x3f, 6);
+    /* remember pushes through R6 */
+    if ((features & FEATURE_SANITIZE) && r1 == R_R6) { san_stack(vm, vm->reg[r1] + offset, 1); }
+    /* write value in source register to memory at base register + offset */
+    return mem_write(vm, vm->reg[r1] + offset, vm->reg[r0], features);
+}
+
+/* stop in the middle of a trap, it runs again on the next lc3_run */
+enum lc3_status retry_trap(struct lc3_vm* vm, enum lc3_status status)
+{
+    --vm->reg[R_PC];
+    /* the trap will run again, so it does not count yet */
+    --vm->instructions;
+    return status;
+}
+
+/* run a registered handler, R7 is already set */
+enum lc3_status native_trap(struct lc3_vm* vm, uint16_t instr)
+{
+    const struct lc3_trap* trap = &vm->traps[instr & 0xFF];
+    uint16_t pc = vm->reg[R_PC] - 1;
+    enum lc3_status status = trap->fn(vm, instr & 0xFF, trap->user);
+    switch (status)
+    {
+        case LC3_RUNNING:
+            return LC3_RUNNING;
+        case LC3_HALTED:
+            vm->halted = 1;
+            return LC3_HALTED;
+        case LC3_FAULT:
+            --vm->instructions;
+            return set_fault(vm, LC3_FAULT_TRAP, pc, instr);
+        default:
+            /* the handler may have moved PC, the trap runs again from where it was */
+            vm->reg[R_PC] = pc;
+            --vm->instructions;
+            return status;
+    }
+}
+
+/* trap instruction */
+enum lc3_status trapInstr(struct lc3_vm* vm, uint16_t instr){
+    PROBE3(trap, vm, instr & 0xFF, vm->reg[R_PC] - 1);
+
+    /* save the program counter in r7*/
+    vm->reg[R_R7] = vm->reg[R_PC];
+
+    /* registered handlers take the place of the built-in traps */
+    if (vm->traps && vm->traps[instr & 0xFF].fn) { return native_trap(vm, instr); }
+
+    switch (instr & 0xFF)
+    {
+        case TRAP_GETC:
+            {
+                if (input_blocked(vm)) { return retry_trap(vm, LC3_NEED_INPUT); }
+                /* read a single ASCII char */
+                vm->reg[R_R0] = next_input(vm);
+                update_flags(vm, R_R0);
+            }
+            break;
+        case TRAP_OUT:
+            {
+                char c = (char)vm->reg[R_R0];
+                if (!emit(vm, &c, 1)) { return retry_trap(vm, LC3_OUTPUT_READY); }
+            }
+            return LC3_OUTPUT_READY;
+        case TRAP_PUTS:
+            {
+                /* one char per word, resuming where a full buffer stopped us */
+                uint16_t a = vm->trap_pending ? vm->trap_cursor : vm->reg[R_R0];
+                vm->trap_pending = 0;
+                while (vm->memory[a])
+                {
+                    char c = (char)vm->memory[a];
+                    if (!emit(vm, &c, 1))
+                    {
+                        vm->trap_pending = 1;
+                        vm->trap_cursor = a;
+                        return retry_trap(vm, LC3_OUTPUT_READY);
+                    }
+                    ++a;
+                }
+            }
+            return LC3_OUTPUT_READY;
+        case TRAP_IN:
+            {
+                /* the prompt is shown once, even if we wait for the key */
+                if (!vm->trap_pending)
+                {
+                    const char prompt[] = "Enter a character: ";
+                    if (!emit(vm, prompt, sizeof(prompt) - 1)) { return retry_trap(vm, LC3_OUTPUT_READY); }
+                    vm->trap_pending = 1;
+                }
+                if (input_blocked(vm)) { return retry_trap(vm, LC3_NEED_INPUT); }
+                /* make room for the echo first, a retry must not lose the key */
+                if (vm->output_len == LC3_OUTPUT_MAX) { return retry_trap(vm, LC3_OUTPUT_READY); }
+                char c = (char)next_input(vm);
+                emit(vm, &c, 1);
+                vm->trap_pending = 0;
+                vm->reg[R_R0] = (uint16_t)c;
+                update_flags(vm, R_R0);
+            }
+            return LC3_OUTPUT_READY;
+        case TRAP_PUTSP:
+            {
+                /* one char per byte (two bytes per word)
+                here we need to swap back to
+                big endian format */
+                uint16_t a = vm->trap_pending ? vm->trap_cursor : vm->reg[R_R0];
+                vm->trap_pending = 0;
+                while (vm->memory[a])
+                {
+                    char chars[2] = { vm->memory[a] & 0xFF, vm->memory[a] >> 8 };
+                    if (!emit(vm, chars, chars[1] ? 2 : 1))
+                    {
+                        vm->trap_pending = 1;
+                        vm->trap_cursor = a;
+                        return retry_trap(vm, LC3_OUTPUT_READY);
+                    }
+                    ++a;
+                }
+            }
+            return LC3_OUTPUT_READY;
+        case TRAP_HALT:
+            {
+                if (!emit(vm, "HALT\n", 5)) { return retry_trap(vm, LC3_OUTPUT_READY); }
+                vm->halted = 1;
+            }
+            return LC3_HALTED;
+    }
+    return LC3_RUNNING;
+}
+
+/* ------------------- signal management ------------------- */
+
+/* set by ctrl-c, the terminal stops the guest at the end of the slice */
+volatile sig_atomic_t interrupted;
+
+void handle_interrupt(int signal)
+{
+    interrupted = 1;
+}
+
+/* without SA_RESTART, so a read waiting for keys returns on ctrl-c */
+void catch_interrupt()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+}
+
+/* ------------------- call tracking ------------------- */
+
+/* start the shadow stack at the current PC */
+void track_calls(struct lc3_vm* vm)
+{
+    if (vm->track_calls) { return; }
+    vm->track_calls = 1;
+    vm->call_depth = 1;
+    vm->calls[0].entry = vm->reg[R_PC];
+    vm->calls[0].ret = vm->reg[R_PC];
+}
+
+/* the guest function executing now */
+uint16_t current_function(struct lc3_vm* vm)
+{
+    return vm->calls[vm->call_depth - 1].entry;
+}
+
+void profile_account(struct lc3_vm* vm, uint64_t now);
+void profile_enter(struct lc3_vm* vm);
+void profile_leave(struct lc3_vm* vm);
+
+/* after JSR/JSRR: the callee returns to R7 */
+void call_entered(struct lc3_vm* vm, uint64_t now)
+{
+    if (vm->profile) { profile_account(vm, now); }
+
+    /* too deep, forget the outermost calls */
+    if (vm->call_depth == LC3_CALL_MAX)
+    {
+        memmove(vm->calls + 1, vm->calls + 2, (LC3_CALL_MAX - 2) * sizeof(vm->calls[0]));
+        --vm->call_depth;
+        if (vm->profile) { profile_leave(vm); }
+    }
+    vm->calls[vm->call_depth].entry = vm->reg[R_PC];
+    vm->calls[vm->call_depth].ret = vm->reg[R_R7];
+    ++vm->call_depth;
+    if (vm->profile) { profile_enter(vm); }
+}
+
+/* after JMP: returns whether it left one or more functions */
+int call_returned(struct lc3_vm* vm, uint64_t now)
+{
+    /* any frame's return address counts, so skipped returns unwind too */
+    for (uint32_t i = vm->call_depth; i > 1; --i)
+    {
+        if (vm->calls[i - 1].ret == vm->reg[R_PC])
+        {
+            if (vm->profile) { profile_account(vm, now); }
+            vm->call_depth = i - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------- call graph profile ------------------- */
+
+/*
+ * instructions are counted per calling context: a tree with one node per
+ * distinct call path. the counts are only updated when the shadow stack
+ * changes, inclusive and exclusive totals are derived when reporting.
+ */
+struct profile_node
+{
+    uint16_t entry;
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint64_t self;          /* instructions executed with this path on top */
+};
+
+#define PROFILE_NONE 0xFFFFFFFF
+
+struct lc3_profile
+{
+    struct profile_node* nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t frame_node[LC3_CALL_MAX];  /* tree node of each shadow frame */
+    uint64_t mark;                      /* instruction count last accounted */
+};
+
+/* the child of parent for calls to entry, created on first use */
+uint32_t profile_child(struct lc3_profile* p, uint32_t parent, uint16_t entry)
+{
+    /* there is a single root, node 0 */
+    if (parent == PROFILE_NONE && p->count > 0) { return 0; }
+    uint32_t n = parent == PROFILE_NONE ? PROFILE_NONE : p->nodes[parent].first_child;
+    for (; n != PROFILE_NONE; n = p->nodes[n].next_sibling)
+    {
+        if (p->nodes[n].entry == entry) { return n; }
+    }
+
+    if (p->count == p->capacity)
+    {
+        uint32_t capacity = p->capacity ? 2 * p->capacity : 256;
+        struct profile_node* grown = realloc(p->nodes, capacity * sizeof(*grown));
+        /* out of memory: keep counting into the parent */
+        if (!grown) { return parent == PROFILE_NONE ? 0 : parent; }
+        p->nodes = grown;
+        p->capacity = capacity;
+    }
+    n = p->count++;
+    p->nodes[n].entry = entry;
+    p->nodes[n].parent = parent;
+    p->nodes[n].first_child = PROFILE_NONE;
+    p->nodes[n].next_sibling = PROFILE_NONE;
+    p->nodes[n].self = 0;
+    if (parent != PROFILE_NONE)
+    {
+        p->nodes[n].next_sibling = p->nodes[parent].first_child;
+        p->nodes[parent].first_child = n;
+    }
+    return n;
+}
+
+/* charge the instructions since the last change to the current path */
+void profile_account(struct lc3_vm* vm, uint64_t now)
+{
+    struct lc3_profile* p = vm->profile;
+    p->nodes[p->frame_node[vm->call_depth - 1]].self += now - p->mark;
+    p->mark = now;
+}
+
+/* a frame was pushed */
+void profile_enter(struct lc3_vm* vm)
+{
+    struct lc3_profile* p = vm->profile;
+    uint32_t top = vm->call_depth - 1;
+    p->frame_node[top] = profile_child(p, p->frame_node[top - 1], vm->calls[top].entry);
+}
+
+/* the outermost call was forgotten, shift the frames down with the stack */
+void profile_leave(struct lc3_vm* vm)
+{
+    struct lc3_profile* p = vm->profile;
+    memmove(p->frame_node + 1, p->frame_node + 2, (LC3_CALL_MAX - 2) * sizeof(p->frame_node[0]));
+}
+
+int lc3_profile_enable(struct lc3_vm* vm)
+{
+    if (vm->profile) { return 1; }
+    vm->profile = calloc(1, sizeof(*vm->profile));
+    if (!vm->profile) { return 0; }
+
+    /* the frames already on the shadow stack become the first path */
+    track_calls(vm);
+    uint32_t parent = PROFILE_NONE;
+    for (uint32_t i = 0; i < vm->call_depth; ++i)
+    {
+        parent = vm->profile->frame_node[i] = profile_child(vm->profile, parent, vm->calls[i].entry);
+    }
+    vm->profile->mark = vm->instructions;
+    return 1;
+}
+
+void lc3_profile_free(struct lc3_vm* vm)
+{
+    if (!vm->profile) { return; }
+    free(vm->profile->nodes);
+    free(vm->profile);
+    vm->profile = NULL;
+}
+
+/* printable name of a guest function */
+void function_name(uint16_t entry, char* name, size_t size)
+{
+    const struct symbol* sym = find_symbol(entry);
+    if (sym && sym->address == entry) { snprintf(name, size, "%s", sym->name); }
+    else { snprintf(name, size, "sub_x%04X", entry); }
+}
+
+/* sum of self counts below each node (children always follow parents) */
+uint64_t* profile_totals(struct lc3_profile* p)
+{
+    uint64_t* total = malloc(p->count * sizeof(*total));
+    if (!total) { return NULL; }
+    for (uint32_t n = 0; n < p->count; ++n) { total[n] = p->nodes[n].self; }
+    for (uint32_t n = p->count; n-- > 1;)
+    {
+        total[p->nodes[n].parent] += total[n];
+    }
+    return total;
+}
+
+struct profile_row
+{
+    uint16_t entry;
+    uint64_t inclusive;
+    uint64_t exclusive;
+};
+
+/* sort the table by exclusive count */
+int compare_profile_rows(const void* a, const void* b)
+{
+    uint64_t x = ((const struct profile_row*)a)->exclusive;
+    uint64_t y = ((const struct profile_row*)b)->exclusive;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void lc3_profile_report(struct lc3_vm* vm, FILE* folded, FILE* table)
+{
+    struct lc3_profile* p = vm->profile;
+    if (!p) { return; }
+    profile_account(vm, vm->instructions);
+
+    uint64_t* total = profile_totals(p);
+    struct profile_row* rows = calloc(MEMORY_MAX, sizeof(*rows));
+    uint16_t* on_path = calloc(MEMORY_MAX, sizeof(*on_path));
+    uint32_t* path = malloc(p->count * sizeof(*path));
+    if (!total || !rows || !on_path || !path)
+    {
+        free(total);
+        free(rows);
+        free(on_path);
+        free(path);
+        return;
+    }
+
+    /* depth first walk, a function recursing counts once toward its inclusive total */
+    uint32_t depth = 0;
+    char line[LC3_CALL_MAX * (SYMBOL_NAME_MAX + 1)];
+    for (uint32_t n = 0; n != PROFILE_NONE;)
+    {
+        struct profile_node* node = &p->nodes[n];
+        path[depth++] = n;
+        rows[node->entry].entry = node->entry;
+        rows[node->entry].exclusive += node->self;
+        if (on_path[node->entry]++ == 0) { rows[node->entry].inclusive += total[n]; }
+
+        if (folded && node->self > 0)
+        {
+            size_t len = 0;
+            for (uint32_t d = 0; d < depth && len < sizeof(line) - SYMBOL_NAME_MAX - 1; ++d)
+            {
+                if (d > 0) { line[len++] = ';'; }
+                function_name(p->nodes[path[d]].entry, line + len, SYMBOL_NAME_MAX + 8);
+                len += strlen(line + len);
+            }
+            fprintf(folded, "%s %llu\n", line, (unsigned long long)node->self);
+        }
+
+        /* next node: first child, else the next sibling of the nearest ancestor */
+        if (node->first_child != PROFILE_NONE)
+        {
+            n = node->first_child;
+            continue;
+        }
+        n = PROFILE_NONE;
+        while (depth > 0 && n == PROFILE_NONE)
+        {
+            struct profile_node* done = &p->nodes[path[--depth]];
+            --on_path[done->entry];
+            n = done->next_sibling;
+        }
+    }
+
+    if (table)
+    {
+        qsort(rows, MEMORY_MAX, sizeof(*rows), compare_profile_rows);
+        fprintf(table, "%-24s %14s %14s\n", "function", "inclusive", "exclusive");
+        for (uint32_t i = 0; i < MEMORY_MAX && (rows[i].inclusive || rows[i].exclusive); ++i)
+        {
+            char name[SYMBOL_NAME_MAX + 8];
+            function_name(rows[i].entry, name, sizeof(name));
+            fprintf(table, "%-24s %14llu %14llu\n", name,
+                (unsigned long long)rows[i].inclusive, (unsigned long long)rows[i].exclusive);
+        }
+    }
+
+    free(total);
+    free(rows);
+    free(on_path);
+    free(path);
+}
+
+/* ------------------- perf ------------------- */
+
+/*
+ * there is no jit, so like cpython's perf trampolines every guest
+ * function gets a tiny copy of native code that just calls the
+ * interpreter. execution of a guest function runs below its trampoline
+ * on the native stack, so samples land in the interpreter and perf
+ * finds the function in their call chains (perf record -g, with frame
+ * pointers). perf learns the trampoline names from /tmp/perf-<pid>.map
+ * and the jitdump file /tmp/jit-<pid>.dump (perf inject --jit).
+ */
+typedef enum lc3_status (*run_fn)(struct lc3_vm* vm, uint64_t budget);
+typedef enum lc3_status (*trampoline_fn)(struct lc3_vm* vm, uint64_t budget, run_fn run);
+
+#if defined(__x86_64__)
+/* push rbp; mov rbp, rsp; call rdx; pop rbp; ret */
+static const uint8_t trampoline_code[] = { 0x55, 0x48, 0x89, 0xE5, 0xFF, 0xD2, 0x5D, 0xC3 };
+#define PERF_ELF_MACHINE 62
+#elif defined(__aarch64__)
+/* stp x29, x30, [sp, #-16]!; mov x29, sp; blr x2; ldp x29, x30, [sp], #16; ret */
+static const uint8_t trampoline_code[] = {
+    0xFD, 0x7B, 0xBF, 0xA9, 0xFD, 0x03, 0x00, 0x91, 0x40, 0x00, 0x3F, 0xD6,
+    0xFD, 0x7B, 0xC1, 0xA8, 0xC0, 0x03, 0x5F, 0xD6
+};
+#define PERF_ELF_MACHINE 183
+#endif
+
+#define TRAMPOLINE_SIZE 32
+#define TRAMPOLINE_ARENA (64 * 1024)
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_CODE_LOAD 0
+
+int perf_enabled = 0;
+FILE* perf_map = NULL;
+FILE* perf_jitdump = NULL;
+uint64_t perf_code_index = 0;
+
+/* one trampoline per guest address, shared by every vm */
+trampoline_fn trampolines[MEMORY_MAX];
+uint8_t* trampoline_arena = NULL;
+size_t trampoline_used = TRAMPOLINE_ARENA;
+char perf_lock = 0;
+
+uint64_t perf_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int lc3_perf_enable(void)
+{
+#ifdef PERF_ELF_MACHINE
+    if (perf_enabled) { return 1; }
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf_map = fopen(path, "w");
+    if (!perf_map) { return 0; }
+
+    /* jitdump is optional, perf map alone already names the trampolines */
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd >= 0)
+    {
+        struct
+        {
+            uint32_t magic, version, total_size, elf_mach, pad1, pid;
+            uint64_t timestamp, flags;
+        } header = { JITDUMP_MAGIC, 1, sizeof(header), PERF_ELF_MACHINE, 0, getpid(), perf_timestamp(), 0 };
+        /* perf record finds the file through this executable mapping */
+        void* marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+        if (write(fd, &header, sizeof(header)) == sizeof(header) && marker != MAP_FAILED)
+        {
+            perf_jitdump = fdopen(fd, "w");
+        }
+        if (!perf_jitdump) { close(fd); }
+    }
+    perf_enabled = 1;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* write the perf map line and jitdump record of a new trampoline */
+void perf_announce(const uint8_t* code, uint16_t entry)
+{
+    char name[SYMBOL_NAME_MAX + 12] = "lc3:";
+    function_name(entry, name + 4, sizeof(name) - 4);
+
+    fprintf(perf_map, "%lx %x %s\n", (unsigned long)(uintptr_t)code, TRAMPOLINE_SIZE, name);
+    fflush(perf_map);
+
+    if (perf_jitdump)
+    {
+        struct
+        {
+            uint32_t id, total_size;
+            uint64_t timestamp;
+            uint32_t pid, tid;
+            uint64_t vma, code_addr, code_size, code_index;
+        } record = {
+            JITDUMP_CODE_LOAD, 0, perf_timestamp(), getpid(), (uint32_t)syscall(SYS_gettid),
+            (uintptr_t)code, (uintptr_t)code, TRAMPOLINE_SIZE, perf_code_index++
+        };
+        record.total_size = sizeof(record) + strlen(name) + 1 + TRAMPOLINE_SIZE;
+        fwrite(&record, sizeof(record), 1, perf_jitdump);
+        fwrite(name, strlen(name) + 1, 1, perf_jitdump);
+        fwrite(code, TRAMPOLINE_SIZE, 1, perf_jitdump);
+        fflush(perf_jitdump);
+    }
+}
+
+/* the trampoline of a guest function, made on first use */
+trampoline_fn get_trampoline(uint16_t entry)
+{
+#ifdef PERF_ELF_MACHINE
+    trampoline_fn t = __atomic_load_n(&trampolines[entry], __ATOMIC_ACQUIRE);
+    if (t) { return t; }
+
+    while (__atomic_test_and_set(&perf_lock, __ATOMIC_ACQUIRE)) {}
+    t = trampolines[entry];
+    if (!t)
+    {
+        if (trampoline_used == TRAMPOLINE_ARENA)
+        {
+            /* every trampoline is the same code, so a new arena is filled
+               while writable and then only ever executed */
+            uint8_t* arena = mmap(NULL, TRAMPOLINE_ARENA, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arena != MAP_FAILED)
+            {
+                for (size_t i = 0; i < TRAMPOLINE_ARENA; i += TRAMPOLINE_SIZE)
+                {
+                    memcpy(arena + i, trampoline_code, sizeof(trampoline_code));
+                }
+                __builtin___clear_cache((char*)arena, (char*)arena + TRAMPOLINE_ARENA);
+                if (mprotect(arena, TRAMPOLINE_ARENA, PROT_READ | PROT_EXEC) == 0)
+                {
+                    trampoline_arena = arena;
+                    trampoline_used = 0;
+                }
+                else
+                {
+                    munmap(arena, TRAMPOLINE_ARENA);
+                }
+            }
+        }
+        if (trampoline_used < TRAMPOLINE_ARENA)
+        {
+            uint8_t* code = trampoline_arena + trampoline_used;
+            trampoline_used += TRAMPOLINE_SIZE;
+            perf_announce(code, entry);
+            t = (trampoline_fn)(uintptr_t)code;
+            __atomic_store_n(&trampolines[entry], t, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_clear(&perf_lock, __ATOMIC_RELEASE);
+    return t;
+#else
+    return NULL;
+#endif
+}
+
+const void* lc3_perf_address(uint16_t entry)
+{
+    return (const void*)(uintptr_t)__atomic_load_n(&trampolines[entry], __ATOMIC_ACQUIRE);
+}
+
+enum lc3_status execute(struct lc3_vm* vm, uint64_t budget);
+
+/* run each stretch of a guest function inside that function's trampoline */
+enum lc3_status perf_run(struct lc3_vm* vm, uint64_t budget)
+{
+    track_calls(vm);
+    uint64_t start = vm->instructions;
+    for (;;)
+    {
+        uint64_t used = vm->instructions - start;
+        if (used >= budget) { return LC3_BUDGET_EXHAUSTED; }
+
+        trampoline_fn t = get_trampoline(current_function(vm));
+        enum lc3_status status = t ? t(vm, budget - used, execute) : execute(vm, budget - used);
+        if (status != LC3_RUNNING) { return status; }
+    }
+}
+
+/* ------------------- embedding api ------------------- */
+
+/* prefer the node of the calling cpu for the pool, the kernel falls back
+   to other nodes when it is full */
+#define MPOL_PREFERRED_NODE 1
+
+size_t pool_bytes(uint32_t count)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (count * sizeof(struct lc3_vm) + page - 1) / page * page;
+}
+
+struct lc3_vm* lc3_pool_alloc(uint32_t count)
+{
+    if (count == 0) { return NULL; }
+    size_t size = pool_bytes(count);
+    void* pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) { return NULL; }
+
+#if defined(SYS_getcpu) && defined(SYS_mbind)
+    /* without numa support this fails and first touch below does the same */
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < 64)
+    {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, pool, size, MPOL_PREFERRED_NODE, &mask, 64, 0);
+    }
+#endif
+    /* first touch from this thread */
+    memset(pool, 0, size);
+    return pool;
+}
+
+void lc3_pool_free(struct lc3_vm* pool, uint32_t count)
+{
+    if (pool) { munmap(pool, pool_bytes(count)); }
+}
+
+int init_vm(struct lc3_vm* vm, enum lc3_memory kind, int fd)
+{
+    memset(vm, 0, sizeof(*vm));
+    vm->memory_kind = kind;
+    vm->memory = memory_alloc(kind, fd);
+
+    /* since exactly one condition flag should be set at any given time, set the Z flag */
+    vm->reg[R_COND] = FL_ZRO;
+
+    /* set the PC to starting position, images may name another entry point */
+    vm->reg[R_PC] = PC_START;
+    return vm->memory != NULL;
+}
+
+int lc3_init(struct lc3_vm* vm)
+{
+    return init_vm(vm, LC3_MEMORY_FLAT, -1);
+}
+
+int lc3_init_memory(struct lc3_vm* vm, enum lc3_memory kind)
+{
+    return init_vm(vm, kind, -1);
+}
+
+struct lc3_image* lc3_image_create(const struct lc3_vm* vm)
+{
+    struct lc3_image* image = malloc(sizeof(*image));
+    if (!image) { return NULL; }
+    image->fd = syscall(SYS_memfd_create, "lc3-image", 0);
+    if (image->fd < 0 || write(image->fd, vm->memory, MEMORY_BYTES) != (ssize_t)MEMORY_BYTES)
+    {
+        if (image->fd >= 0) { close(image->fd); }
+        free(image);
+        return NULL;
+    }
+    image->pc = vm->reg[R_PC];
+    image->entry_point_set = vm->entry_point_set;
+    memcpy(image->loaded, vm->loaded, sizeof(image->loaded));
+    return image;
+}
+
+int lc3_init_image(struct lc3_vm* vm, const struct lc3_image* image)
+{
+    if (!init_vm(vm, LC3_MEMORY_SHARED, image->fd)) { return 0; }
+    vm->reg[R_PC] = image->pc;
+    vm->entry_point_set = image->entry_point_set;
+    memcpy(vm->loaded, image->loaded, sizeof(vm->loaded));
+    return 1;
+}
+
+void lc3_image_free(struct lc3_image* image)
+{
+    if (!image) { return; }
+    close(image->fd);
+    free(image);
+}
+
+struct lc3_window* lc3_window_create(uint32_t words)
+{
+    if (words == 0 || words % LC3_WINDOW_WORDS || words > MEMORY_MAX) { return NULL; }
+    struct lc3_window* window = malloc(sizeof(*window));
+    if (!window) { return NULL; }
+    window->words = words;
+    window->fd = syscall(SYS_memfd_create, "lc3-window", 0);
+    window->data = MAP_FAILED;
+    if (window->fd >= 0 && ftruncate(window->fd, words * sizeof(uint16_t)) == 0)
+    {
+        window->data = mmap(NULL, words * sizeof(uint16_t), PROT_READ | PROT_WRITE, MAP_SHARED, window->fd, 0);
+    }
+    if (window->data == MAP_FAILED)
+    {
+        if (window->fd >= 0) { close(window->fd); }
+        free(window);
+        return NULL;
+    }
+    return window;
+}
+
+uint16_t* lc3_window_data(const struct lc3_window* window)
+{
+    return window->data;
+}
+
+int lc3_window_map(struct lc3_vm* vm, const struct lc3_window* window, uint16_t address)
+{
+    uint32_t end = address + window->words;
+    if (address % LC3_WINDOW_WORDS || end > (MR_KBSR & ~(LC3_WINDOW_WORDS - 1))) { return 0; }
+    for (uint32_t a = address; a < end; ++a)
+    {
+        if (vm->loaded[a >> 3] & (1 << (a & 7))) { return 0; }
+    }
+    if (!memory_map_window(vm, window, address)) { return 0; }
+
+    /* the host fills it, so it counts as loaded: initialized, and images keep out */
+    for (uint32_t a = address; a < end; ++a)
+    {
+        vm->loaded[a >> 3] |= 1 << (a & 7);
+    }
+    if (vm->sanitizer) { memset(vm->sanitizer->shadow + address, SHADOW_INIT, window->words); }
+    return 1;
+}
+
+void lc3_window_free(struct lc3_window* window)
+{
+    if (!window) { return; }
+    munmap(window->data, window->words * sizeof(uint16_t));
+    close(window->fd);
+    free(window);
+}
+
+void lc3_free(struct lc3_vm* vm)
+{
+    lc3_profile_free(vm);
+    lc3_heatmap_free(vm);
+    lc3_sanitize_free(vm);
+    free(vm->traps);
+    vm->traps = NULL;
+    memory_release(vm);
+}
+
+int lc3_load(struct lc3_vm* vm, const char* image_path)
+{
+    int ok = read_image(vm, image_path);
+    PROBE3(image_load, vm, image_path, ok);
+    return ok;
+}
+
+int lc3_load_words(struct lc3_vm* vm, uint16_t origin, const uint16_t* words, uint32_t count)
+{
+    return place_segment(vm, origin, words, count);
+}
+
+size_t lc3_push_input(struct lc3_vm* vm, const char* data, size_t size)
+{
+    size_t n = 0;
+    while (n < size && vm->input_count < LC3_INPUT_MAX)
+    {
+        vm->input[(vm->input_head + vm->input_count) % LC3_INPUT_MAX] = data[n++];
+        ++vm->input_count;
+    }
+    return n;
+}
+
+void lc3_close_input(struct lc3_vm* vm)
+{
+    vm->input_closed = 1;
+}
+
+size_t lc3_read_output(struct lc3_vm* vm, char* data, size_t size)
+{
+    size_t n = size < vm->output_len ? size : vm->output_len;
+    memcpy(data, vm->output, n);
+    memmove(vm->output, vm->output + n, vm->output_len - n);
+    vm->output_len -= n;
+    return n;
+}
+
+/* run until the budget is spent or the guest needs the host */
+SPECIALIZED enum lc3_status execute_with(struct lc3_vm* vm, uint64_t budget, unsigned features)
+{
+    enum lc3_status status = LC3_RUNNING;
+    uint64_t left = budget;
+    int running = 1;
+    /* the fetch probe counts retired instructions, only while traced */
+    int probing = PROBE_ENABLED(fetch);
+    uint64_t probe_next = (vm->instructions + PROBE_SAMPLE - 1) & ~(uint64_t)(PROBE_SAMPLE - 1);
+    while (running && left > 0)
+    {
+        if (probing && vm->instructions + budget - left >= probe_next)
+        {
+            uint64_t retired = vm->instructions + budget - left;
+            PROBE3(fetch, vm, vm->reg[R_PC], retired);
+            /* delay loops skip ahead, so sample the next multiple from here */
+            probe_next = (retired | (PROBE_SAMPLE - 1)) + 1;
+        }
+        --left;
+
+        /* FETCH */
+        uint16_t instr = fetch(vm, features);
+        uint16_t op = instr >> 12;
+
+        /* find instruction for the opcode */
+        switch (op)
+        {
+            case OP_ADD:
+                addInstr(vm, instr);
+                break;
+            case OP_AND:
+                andInstr(vm, instr);
+                break;
+            case OP_NOT:
+                notInstr(vm, instr);
+                break;
+            case OP_BR:
+                brInstr(vm, instr);
+                /* a taken branch two words back may close a delay loop, skipped
+                   unless a tool watches every fetch */
+                if (!(features & (FEATURE_HEATMAP | FEATURE_SANITIZE)) && (instr & 0x1FF) == 0x1FE && (instr >> 9) & vm->reg[R_COND])
+                {
+                    left -= skip_delay_loop(vm, instr, left);
+                }
+                break;
+            case OP_JMP:
+                jmpInstr(vm, instr);
+                /* perf needs to switch trampolines when the function changes */
+                if ((features & FEATURE_CALLS) && call_returned(vm, vm->instructions + budget - left))
+                {
+                    running = !perf_enabled;
+                }
+                break;
+            case OP_JSR:
+                jsrInstr(vm, instr);
+                if (features & FEATURE_CALLS)
+                {
+                    call_entered(vm, vm->instructions + budget - left);
+                    running = !perf_enabled;
+                }
+                break;
+            case OP_LD:
+                ldInstr(vm, instr, features);
+                break;
+            case OP_LDI:
+                ldiInstr(vm, instr, features);
+                break;
+            case OP_LDR:
+                ldrInstr(vm, instr, features);
+                break;
+            case OP_LEA:
+                leaInstr(vm, instr);
+                break;
+            /* stores stop the slice after ringing the doorbell */
+            case OP_ST:
+                if (stInstr(vm, instr, features)) { status = LC3_DOORBELL; running = 0; }
+                break;
+            case OP_STI:
+                if (stiInstr(vm, instr, features)) { status = LC3_DOORBELL; running = 0; }
+                break;
+            case OP_STR:
+                if (strInstr(vm, instr, features)) { status = LC3_DOORBELL; running = 0; }
+                break;
+            case OP_TRAP:
+                status = trapInstr(vm, instr);
+                running = status == LC3_RUNNING;
+                break;
+            case OP_RTI:
+                status = raise_fault(vm, LC3_FAULT_PRIVILEGE, instr);
+                running = 0;
+                break;
+            case OP_RES:
+            default:
+                status = raise_fault(vm, LC3_FAULT_ILLEGAL_OPCODE, instr);
+                running = 0;
+                break;
+        }
+    }
+
+    vm->instructions += budget - left;
+    if (status == LC3_HALTED) { PROBE3(halt, vm, vm->reg[R_PC], vm->instructions); }
+    /* LC3_RUNNING here means we stopped early for a call or return */
+    return running ? LC3_BUDGET_EXHAUSTED : status;
+}
+
+/* one copy of the loop per combination of tools */
+#define EXECUTE_AS(f) \
+    enum lc3_status execute_##f(struct lc3_vm* vm, uint64_t budget) { return execute_with(vm, budget, f); }
+
+EXECUTE_AS(0) EXECUTE_AS(1) EXECUTE_AS(2) EXECUTE_AS(3)
+EXECUTE_AS(4) EXECUTE_AS(5) EXECUTE_AS(6) EXECUTE_AS(7)
+
+enum lc3_status (* const executors[FEATURE_COMBINATIONS])(struct lc3_vm*, uint64_t) = {
+    execute_0, execute_1, execute_2, execute_3, execute_4, execute_5, execute_6, execute_7
+};
+
+/* the copy for the tools attached now. tools are attached between calls to
+   lc3_run, so every slice starts at a point where switching is safe */
+enum lc3_status execute(struct lc3_vm* vm, uint64_t budget)
+{
+    unsigned features = (vm->heatmap ? FEATURE_HEATMAP : 0) | (vm->sanitizer ? FEATURE_SANITIZE : 0)
+        | (vm->track_calls ? FEATURE_CALLS : 0);
+    return executors[features](vm, budget);
+}
+
+enum lc3_status lc3_run(struct lc3_vm* vm, uint64_t budget)
+{
+    if (vm->halted) { return vm->fault.kind ? LC3_FAULT : LC3_HALTED; }
+
+    /* the limit only shortens the slice, the loop never looks at it */
+    uint64_t limit = vm->instruction_limit;
+    if (limit && budget >= limit - vm->instructions)
+    {
+        if (vm->instructions >= limit) { return set_fault(vm, LC3_FAULT_LIMIT, vm->reg[R_PC], vm->memory[vm->reg[R_PC]]); }
+        budget = limit - vm->instructions;
+    }
+
+    enum lc3_status status = perf_enabled ? perf_run(vm, budget) : execute(vm, budget);
+    if (status == LC3_BUDGET_EXHAUSTED && limit && vm->instructions >= limit)
+    {
+        return set_fault(vm, LC3_FAULT_LIMIT, vm->reg[R_PC], vm->memory[vm->reg[R_PC]]);
+    }
+    return status;
+}
+
+/* ------------------- terminal ------------------- */
+
+/* instructions between looks at the keyboard */
+#define RUN_SLICE (1 << 16)
+
+/* move whatever the terminal has into the input queue, blocks if nothing */
+void read_keys(struct lc3_vm* vm)
+{
+    char buf[LC3_INPUT_MAX];
+    size_t space = LC3_INPUT_MAX - vm->input_count;
+    if (space == 0 || vm->input_closed) { return; }
+
+    ssize_t n = read(STDIN_FILENO, buf, space);
+    if (n > 0) { lc3_push_input(vm, buf, n); }
+    else if (n == 0) { lc3_close_input(vm); }
+}
+
+/* write the guest's output to the terminal */
+void flush_output(struct lc3_vm* vm)
+{
+    if (vm->output_len == 0) { return; }
+    fwrite(vm->output, 1, vm->output_len, stdout);
+    fflush(stdout);
+    vm->output_len = 0;
+}
+
+/* run a vm on the terminal until HALT, a fault or ctrl-c, returns the
+   exit status */
+int run(struct lc3_vm* vm)
+{
+    while (!interrupted)
+    {
+        /* keys typed while the guest runs, for guests polling KBSR */
+        if (check_key()) { read_keys(vm); }
+
+        enum lc3_status status = lc3_run(vm, RUN_SLICE);
+        flush_output(vm);
+        if (status == LC3_HALTED) { return 0; }
+        if (status == LC3_FAULT)
+        {
+            lc3_fault_report(vm, stderr);
+            return 1;
+        }
+        if (status == LC3_NEED_INPUT) { read_keys(vm); }
+    }
+    printf("\n");
+    return -2;
+}
+
+/* ------------------- batch runs ------------------- */
+
+/* what a guest did with one input, all of it is deterministic */
+struct batch_result
+{
+    enum lc3_status status;         /* LC3_HALTED or LC3_FAULT, LC3_RUNNING when interrupted */
+    uint64_t instructions;
+    struct lc3_fault fault;
+    char* output;                   /* malloc'd */
+    size_t output_len;
+};
+
+/* keep the console output of a batch run */
+int batch_output(struct lc3_vm* vm, struct batch_result* r, size_t* capacity)
+{
+    if (r->output_len + vm->output_len > *capacity)
+    {
+        size_t grown = (*capacity ? *capacity : LC3_OUTPUT_MAX) * 2;
+        while (grown < r->output_len + vm->output_len) { grown *= 2; }
+        char* output = realloc(r->output, grown);
+        if (!output) { return 0; }
+        r->output = output;
+        *capacity = grown;
+    }
+    memcpy(r->output + r->output_len, vm->output, vm->output_len);
+    r->output_len += vm->output_len;
+    vm->output_len = 0;
+    return 1;
+}
+
+/* run_batch in steps: stop once the guest has retired stop instructions.
+   pushed and capacity carry over from one step to the next */
+int run_batch_until(struct lc3_vm* vm, const char* input, size_t input_len, size_t* pushed, uint64_t stop,
+    struct batch_result* r, size_t* capacity)
+{
+    while (!interrupted && vm->instructions < stop)
+    {
+        uint64_t budget = stop - vm->instructions;
+        enum lc3_status status = lc3_run(vm, budget < RUN_SLICE ? budget : RUN_SLICE);
+        if (!batch_output(vm, r, capacity)) { return 0; }
+        if (status == LC3_HALTED || status == LC3_FAULT)
+        {
+            r->status = status;
+            break;
+        }
+        if (status == LC3_NEED_INPUT)
+        {
+            *pushed += lc3_push_input(vm, input + *pushed, input_len - *pushed);
+            if (*pushed == input_len) { lc3_close_input(vm); }
+        }
+    }
+    r->instructions = vm->instructions;
+    r->fault = vm->fault;
+    return 1;
+}
+
+/* run a loaded vm on input until HALT, a fault or ctrl-c, without a
+   terminal. input ends in EOF. returns 0 when out of memory */
+int run_batch(struct lc3_vm* vm, const char* input, size_t input_len, struct batch_result* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->status = LC3_RUNNING;
+    size_t capacity = 0;
+    size_t pushed = 0;
+    return run_batch_until(vm, input, input_len, &pushed, UINT64_MAX, r, &capacity);
+}
+
+/* print a batch result like the terminal would, returns the exit status */
+int batch_exit(struct lc3_vm* vm, const struct batch_result* r)
+{
+    fwrite(r->output, 1, r->output_len, stdout);
+    fflush(stdout);
+    if (r->status == LC3_FAULT)
+    {
+        vm->fault = r->fault;
+        lc3_fault_report(vm, stderr);
+        return 1;
+    }
+    return r->status == LC3_HALTED ? 0 : -2;
+}
+
+/*
+ * byte strings in results and job frames are blobs: length:32 and
+ * words:32, then the bytes paired big-endian into words (an odd last
+ * byte with a zero) as an lz16 stream of that many words. words is 0
+ * when lz16 would not make them smaller, and the bytes follow as is.
+ */
+#define BLOB_HEADER_SIZE (4 + 4)
+
+void put_blob(FILE* out, const char* data, size_t len)
+{
+    uint32_t count = (len + 1) / 2;
+    uint16_t* words = malloc((count + lz16_bound(count)) * sizeof(uint16_t));
+    uint16_t* packed = words + count;
+    uint32_t packed_count = 0;
+    if (words)
+    {
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint8_t low = 2 * i + 1 < len ? data[2 * i + 1] : 0;
+            words[i] = (uint16_t)((uint8_t)data[2 * i] << 8 | low);
+        }
+        packed_count = lz16_compress(words, count, packed);
+    }
+    put_be32(out, len);
+    if (words && (size_t)packed_count * 2 < len)
+    {
+        put_be32(out, packed_count);
+        for (uint32_t i = 0; i < packed_count; ++i) { put_be16(out, packed[i]); }
+    }
+    else
+    {
+        put_be32(out, 0);
+        fwrite(data, 1, len, out);
+    }
+    free(words);
+}
+
+/* bytes that follow a blob header */
+size_t blob_size(const uint8_t* h)
+{
+    uint32_t words = get_be32(h + 4);
+    return words ? (size_t)words * 2 : get_be32(h);
+}
+
+/* the bytes of a blob, malloc'd with room for a terminator. NULL when
+   out of memory or the lz16 stream is corrupt */
+char* blob_bytes(const uint8_t* h, const uint8_t* body)
+{
+    size_t len = get_be32(h);
+    uint32_t packed_count = get_be32(h + 4);
+    char* data = malloc(len + 1);
+    if (!data || packed_count == 0)
+    {
+        if (data) { memcpy(data, body, len); }
+        return data;
+    }
+    uint32_t count = (len + 1) / 2;
+    uint16_t* words = malloc(((size_t)count + packed_count) * sizeof(uint16_t));
+    uint16_t* packed = words + count;
+    int ok = words != NULL;
+    for (uint32_t i = 0; ok && i < packed_count; ++i) { packed[i] = get_be16(body + 2 * i); }
+    ok = ok && lz16_decompress(packed, packed_count, words, count) == count;
+    for (size_t i = 0; ok && i < len; ++i)
+    {
+        data[i] = (char)(i & 1 ? words[i / 2] & 0xFF : words[i / 2] >> 8);
+    }
+    free(words);
+    if (!ok)
+    {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+/* status, instructions, fault kind, pc, instr, registers and the output
+   as a blob, integers big-endian */
+#define RESULT_HEADER_SIZE (1 + 8 + 1 + 2 + 2 + 2 * R_COUNT + BLOB_HEADER_SIZE)
+#define RESULT_BLOB (RESULT_HEADER_SIZE - BLOB_HEADER_SIZE)
+
+void put_result(FILE* out, const struct batch_result* r)
+{
+    putc(r->status, out);
+    put_be64(out, r->instructions);
+    putc(r->fault.kind, out);
+    put_be16(out, r->fault.pc);
+    put_be16(out, r->fault.instr);
+    for (int i = 0; i < R_COUNT; ++i) { put_be16(out, r->fault.reg[i]); }
+    put_blob(out, r->output, r->output_len);
+}
+
+/* fill r from a header, the caller reads blob_size(h + RESULT_BLOB)
+   bytes and passes them to result_output */
+void parse_result(const uint8_t* h, struct batch_result* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->status = h[0];
+    r->instructions = get_be64(h + 1);
+    r->fault.kind = h[9];
+    r->fault.pc = get_be16(h + 10);
+    r->fault.instr = get_be16(h + 12);
+    for (int i = 0; i < R_COUNT; ++i) { r->fault.reg[i] = get_be16(h + 14 + 2 * i); }
+    r->output_len = get_be32(h + RESULT_BLOB);
+}
+
+/* unpack the output that follows header h, returns 0 when it is corrupt */
+int result_output(const uint8_t* h, const uint8_t* body, struct batch_result* r)
+{
+    r->output = blob_bytes(h + RESULT_BLOB, body);
+    return r->output != NULL;
+}
+
+/* all of stdin, returns NULL when out of memory */
+char* read_all(FILE* in, size_t* size)
+{
+    size_t capacity = 1 << 12;
+    char* data = malloc(capacity);
+    *size = 0;
+    size_t n;
+    while (data && (n = fread(data + *size, 1, capacity - *size, in)) > 0)
+    {
+        *size += n;
+        if (*size == capacity)
+        {
+            char* grown = realloc(data, capacity *= 2);
+            if (!grown) { free(data); }
+            data = grown;
+        }
+    }
+    return data;
+}
+
+/* ------------------- result cache ------------------- */
+
+/*
+ * batch results keyed by the sha-256 of guest memory, the entry point,
+ * the instruction limit and the input. the key is collision resistant,
+ * so a crafted image cannot be served another image's result. an entry
+ * is one file named after its key, replaced with rename so that
+ * processes can share a cache. hits touch the file.
+ *
+ * DIR/.size keeps the total size of the entries, updated under flock.
+ * only when a store takes it past the limit is the directory scanned,
+ * and the least recently used entries are deleted down to 90% of it.
+ *
+ * "LC3R", version, key and the result.
+ */
+#define CACHE_MAGIC "LC3R"
+#define CACHE_VERSION 3
+#define CACHE_KEY_SIZE 32
+#define CACHE_HEADER_SIZE (4 + 2 + CACHE_KEY_SIZE + RESULT_HEADER_SIZE)
+#define CACHE_SIZE_FILE ".size"
+
+struct sha256
+{
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t length;                /* bytes hashed so far */
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+uint32_t rotr32(uint32_t x, int n) { return x >> n | x << (32 - n); }
+
+void sha256_init(struct sha256* s)
+{
+    static const uint32_t h0[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    memcpy(s->h, h0, sizeof(h0));
+    s->length = 0;
+}
+
+void sha256_block(struct sha256* s, const uint8_t* p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) { w[i] = get_be32(p + 4 * i); }
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_update(struct sha256* s, const void* data, size_t size)
+{
+    const uint8_t* p = data;
+    while (size > 0)
+    {
+        size_t used = s->length % 64;
+        size_t n = 64 - used < size ? 64 - used : size;
+        memcpy(s->block + used, p, n);
+        s->length += n;
+        p += n;
+        size -= n;
+        if (s->length % 64 == 0) { sha256_block(s, s->block); }
+    }
+}
+
+void sha256_final(struct sha256* s, uint8_t digest[32])
+{
+    uint64_t bits = s->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (s->length % 64 < 56 ? 56 : 120) - s->length % 64;
+    for (int i = 0; i < 8; ++i) { pad[pad_len + i] = (uint8_t)(bits >> (56 - 8 * i)); }
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int j = 0; j < 4; ++j) { digest[4 * i + j] = (uint8_t)(s->h[i] >> (24 - 8 * j)); }
+    }
+}
+
+void cache_key(const struct lc3_vm* vm, const char* input, size_t input_len, uint8_t key[CACHE_KEY_SIZE])
+{
+    struct sha256 s;
+    uint64_t len = input_len;
+    sha256_init(&s);
+    sha256_update(&s, vm->memory, MEMORY_BYTES);
+    sha256_update(&s, &vm->reg[R_PC], sizeof(vm->reg[R_PC]));
+    sha256_update(&s, &vm->instruction_limit, sizeof(vm->instruction_limit));
+    sha256_update(&s, &len, sizeof(len));
+    sha256_update(&s, input, input_len);
+    sha256_final(&s, key);
+}
+
+/* dir/prefix followed by the key in hex */
+void cache_path(char* path, size_t size, const char* dir, const char* prefix, const uint8_t* key)
+{
+    int n = snprintf(path, size, "%s/%s", dir, prefix);
+    for (int i = 0; i < CACHE_KEY_SIZE && n >= 0 && (size_t)n + 2 < size; ++i, n += 2)
+    {
+        snprintf(path + n, size - n, "%02x", key[i]);
+    }
+}
+
+/* fill r from the entry for key, returns 0 on a miss */
+int cache_lookup(const char* dir, const uint8_t* key, struct batch_result* r)
+{
+    char path[512];
+    cache_path(path, sizeof(path), dir, "", key);
+    FILE* file = fopen(path, "rb");
+    if (!file) { return 0; }
+    uint8_t h[CACHE_HEADER_SIZE];
+    int ok = fread(h, 1, sizeof(h), file) == sizeof(h) && memcmp(h, CACHE_MAGIC, 4) == 0
+        && get_be16(h + 4) == CACHE_VERSION && memcmp(h + 6, key, CACHE_KEY_SIZE) == 0;
+    const uint8_t* result = h + 6 + CACHE_KEY_SIZE;
+    if (ok)
+    {
+        parse_result(result, r);
+        size_t size = blob_size(result + RESULT_BLOB);
+        uint8_t* body = malloc(size + 1);
+        ok = body && fread(body, 1, size, file) == size && result_output(result, body, r);
+        free(body);
+    }
+    fclose(file);
+
+    /* the file time orders entries for eviction */
+    if (ok) { utimensat(AT_FDCWD, path, NULL, 0); }
+    return ok;
+}
+
+struct cache_entry
+{
+    char name[2 * CACHE_KEY_SIZE + 1];
+    uint64_t used;                  /* modification time in ns */
+    off_t size;
+};
+
+int cache_older(const void* a, const void* b)
+{
+    uint64_t x = ((const struct cache_entry*)a)->used;
+    uint64_t y = ((const struct cache_entry*)b)->used;
+    return (x > y) - (x < y);
+}
+
+/* delete least recently used entries until dir holds at most limit
+   bytes, returns the bytes left */
+uint64_t cache_trim(const char* dir, uint64_t limit)
+{
+    DIR* d = opendir(dir);
+    if (!d) { return 0; }
+    struct cache_entry* entries = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t total = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL)
+    {
+        /* only entries, not temporary files or anything else */
+        size_t len = strlen(e->d_name);
+        if (len != 2 * CACHE_KEY_SIZE || strspn(e->d_name, "0123456789abcdef") != len) { continue; }
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (stat(path, &st) != 0) { continue; }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct cache_entry* grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) { break; }
+            entries = grown;
+        }
+        strcpy(entries[count].name, e->d_name);
+        entries[count].used = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        ++count;
+    }
+    closedir(d);
+
+    qsort(entries, count, sizeof(*entries), cache_older);
+    for (size_t i = 0; i < count && total > limit; ++i)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+        if (unlink(path) == 0) { total -= entries[i].size; }
+    }
+    free(entries);
+    return total;
+}
+
+/* count a new entry of size bytes in DIR/.size, scanning and trimming
+   the directory only once the total passes limit. a missing or damaged
+   size file is rebuilt by a scan */
+void cache_grow(const char* dir, uint64_t size, uint64_t limit)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" CACHE_SIZE_FILE, dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) { return; }
+    flock(fd, LOCK_EX);
+    uint8_t b[8];
+    int known = pread(fd, b, sizeof(b), 0) == sizeof(b);
+    uint64_t total = known ? get_be64(b) + size : UINT64_MAX;
+    if (total > limit) { total = cache_trim(dir, limit - limit / 10); }
+    for (int i = 0; i < 8; ++i) { b[i] = (uint8_t)(total >> (56 - 8 * i)); }
+    if (pwrite(fd, b, sizeof(b), 0) != sizeof(b)) { ftruncate(fd, 0); }
+    close(fd);
+}
+
+/* store r under key, then keep the cache within limit bytes */
+int cache_store(const char* dir, const uint8_t* key, const struct batch_result* r, uint64_t limit)
+{
+    char path[512];
+    char temp[512];
+    char prefix[32];
+    cache_path(path, sizeof(path), dir, "", key);
+    snprintf(prefix, sizeof(prefix), ".%d.", (int)getpid());
+    cache_path(temp, sizeof(temp), dir, prefix, key);
+    FILE* out = fopen(temp, "wb");
+    if (!out) { return 0; }
+    fputs(CACHE_MAGIC, out);
+    put_be16(out, CACHE_VERSION);
+    fwrite(key, 1, CACHE_KEY_SIZE, out);
+    put_result(out, r);
+    long size = ftell(out);
+    int ok = fclose(out) == 0 && size > 0 && rename(temp, path) == 0;
+    if (!ok) { unlink(temp); }
+    if (ok) { cache_grow(dir, size, limit); }
+    return ok;
+}
+
+/* run_batch through the cache in dir unless it is NULL */
+int run_cached(struct lc3_vm* vm, const char* input, size_t input_len, const char* dir, uint64_t cache_limit,
+    struct batch_result* r)
+{
+    if (!dir) { return run_batch(vm, input, input_len, r); }
+    mkdir(dir, 0777);
+    uint8_t key[CACHE_KEY_SIZE];
+    cache_key(vm, input, input_len, key);
+    if (cache_lookup(dir, key, r)) { return 1; }
+    if (!run_batch(vm, input, input_len, r)) { return 0; }
+    /* an interrupted run is not a result */
+    if (r->status != LC3_RUNNING) { cache_store(dir, key, r, cache_limit); }
+    return 1;
+}
+
+/* run on all of stdin, returns the exit status */
+int run_stdin(struct lc3_vm* vm, const char* dir, uint64_t cache_limit)
+{
+    size_t input_len;
+    char* input = read_all(stdin, &input_len);
+    struct batch_result r;
+    if (!input || !run_cached(vm, input, input_len, dir, cache_limit, &r))
+    {
+        printf("out of memory\n");
+        free(input);
+        return 1;
+    }
+    int status = batch_exit(vm, &r);
+    free(r.output);
+    free(input);
+    return status;
+}
+
+/* ------------------- zygote ------------------- */
+
+/* pid of the guest forked for us by the zygote (client side) */
+pid_t zygote_child = 0;
+
+/* most descriptors passed in one message (stdin and stdout) */
+#define ZYGOTE_FDS 2
+
+/* control buffer sized and aligned for ZYGOTE_FDS descriptors */
+union fd_control
+{
+    char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct cmsghdr align;
+};
+
+/* send file descriptors over a unix socket (SCM_RIGHTS) */
+int send_fds(int sock, const int* fds, int count)
+{
+    if (count < 1 || count > ZYGOTE_FDS) { return 0; }
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union fd_control control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, 0) == 1;
+}
+
+/* receive file descriptors sent with send_fds */
+int recv_fds(int sock, int* fds, int count)
+{
+    if (count < 1 || count > ZYGOTE_FDS) { return 0; }
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union fd_control control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    if (recvmsg(sock, &msg, 0) != 1) { return 0; }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || (msg.msg_flags & MSG_CTRUNC) || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(count * sizeof(int)))
+    {
+        return 0;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    return 1;
+}
+
+/* open a unix stream socket bound (listen) or connected to path */
+int unix_socket(const char* path, int listening)
+{
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { return -1; }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) { return -1; }
+    if (listening)
+    {
+        unlink(path);
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 64) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    else if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* serve forever: every connection gets a forked copy of the loaded images */
+void zygote_serve(struct lc3_vm* vm, const char* path)
+{
+    int server = unix_socket(path, 1);
+    if (server < 0)
+    {
+        printf("failed to listen on: %s\n", path);
+        exit(1);
+    }
+    /* children are never waited for */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;)
+    {
+        int conn = accept(server, NULL, NULL);
+        if (conn < 0) { continue; }
+
+        /* the client's stdin and stdout */
+        int fds[ZYGOTE_FDS];
+        if (!recv_fds(conn, fds, ZYGOTE_FDS))
+        {
+            close(conn);
+            continue;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(server);
+            dup2(fds[0], STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+
+            /* the pid goes first, before the guest can halt and send its
+               status on the same connection */
+            pid_t self = getpid();
+            if (write(conn, &self, sizeof(self)) != sizeof(self)) { _exit(1); }
+
+            signal(SIGCHLD, SIG_DFL);
+            catch_interrupt();
+            disable_input_buffering();
+            char status = run(vm);
+            restore_input_buffering();
+            fflush(stdout);
+
+            /* tell the client how the guest stopped */
+            write(conn, &status, 1);
+            _exit(0);
+        }
+
+        close(fds[0]);
+        close(fds[1]);
+        close(conn);
+    }
+}
+
+/* forward ctrl-c to the guest running in the zygote */
+void forward_interrupt(int signal)
+{
+    if (zygote_child > 0) { kill(zygote_child, SIGINT); }
+}
+
+/* hand our stdin/stdout to a zygote and wait for the guest to halt */
+int zygote_connect(const char* path)
+{
+    int sock = unix_socket(path, 0);
+    if (sock < 0)
+    {
+        printf("failed to connect to: %s\n", path);
+        return 1;
+    }
+
+    int fds[ZYGOTE_FDS] = { STDIN_FILENO, STDOUT_FILENO };
+    if (!send_fds(sock, fds, ZYGOTE_FDS)
+        || read(sock, &zygote_child, sizeof(zygote_child)) != sizeof(zygote_child))
+    {
+        printf("zygote refused the connection\n");
+        return 1;
+    }
+    signal(SIGINT, forward_interrupt);
+
+    char status;
+    ssize_t n;
+    while ((n = read(sock, &status, 1)) < 0 && errno == EINTR) {}
+    close(sock);
+    /* no status means the guest was interrupted */
+    return n == 1 ? status : 2;
+}
+
+/* ------------------- distributed batches ------------------- */
+
+/*
+ * a coordinator reads a manifest with one job per line, an image file and
+ * optionally an input file, and hands the jobs to workers connected over
+ * tcp. a job whose worker disconnects, or has not answered by the job's
+ * deadline, goes back in the queue, up to JOB_ATTEMPTS times, and the
+ * worker is dropped. results go to stdout as they arrive, each one its
+ * job's line number (from 0) followed by the result. a job that failed
+ * on every attempt has status 0.
+ *
+ * worker sockets are non-blocking. frames go out and results come in
+ * piece by piece as poll allows, buffered per worker, so no worker can
+ * hold up the others.
+ *
+ * a job frame is id, limit, the image and the input as blobs, and a
+ * worker answers with id and the result. integers are big-endian.
+ */
+#define JOB_ATTEMPTS 3
+#define JOB_HEADER_SIZE (4 + 8 + BLOB_HEADER_SIZE)
+#define WORKERS_MAX 256
+
+/* instructions and seconds a job may take unless --limit or --timeout say otherwise */
+#define JOB_LIMIT 1000000000
+#define JOB_SECONDS 600
+
+/* a result larger than this is a protocol error */
+#define JOB_RESULT_MAX (256 << 20)
+
+struct job
+{
+    char* image;
+    size_t image_len;
+    char* input;
+    size_t input_len;
+    int attempts;
+};
+
+struct worker
+{
+    int fd;
+    int32_t job;                    /* job it runs, -1 when idle */
+    uint64_t deadline;              /* monotonic ms by which the job must be answered */
+    char* frame;                    /* job frame still being sent, NULL when sent */
+    size_t frame_len;
+    size_t frame_sent;
+    uint8_t* result;                /* the answer received so far */
+    size_t result_len;
+    size_t result_capacity;
+};
+
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int send_all(int fd, const void* data, size_t size)
+{
+    const char* p = data;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int recv_all(int fd, void* data, size_t size)
+{
+    char* p = data;
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/* send what was written to a memstream, then free it. fclose sets data
+   and size, so they are passed by address */
+int send_stream(int fd, FILE* frame, char** data, size_t* size)
+{
+    int ok = fclose(frame) == 0 && send_all(fd, *data, *size);
+    free(*data);
+    return ok;
+}
+
+/* a listening socket on port, or one connected to host:port */
+int tcp_socket(const char* host, const char* port, int listening)
+{
+    struct addrinfo hints = { 0 };
+    struct addrinfo* addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0) { return -1; }
+
+    int sock = -1;
+    for (struct addrinfo* a = addrs; a && sock < 0; a = a->ai_next)
+    {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock < 0) { continue; }
+        int one = 1;
+        int ok;
+        if (listening)
+        {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(sock, a->ai_addr, a->ai_addrlen) == 0 && listen(sock, 64) == 0;
+        }
+        else
+        {
+            ok = connect(sock, a->ai_addr, a->ai_addrlen) == 0;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (!ok)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return sock;
+}
+
+/* read a manifest, returns the number of jobs or -1 */
+int read_manifest(const char* path, struct job** jobs)
+{
+    FILE* manifest = fopen(path, "r");
+    if (!manifest)
+    {
+        printf("failed to read manifest: %s\n", path);
+        return -1;
+    }
+    int count = 0;
+    int capacity = 0;
+    *jobs = NULL;
+    char line[1024];
+    while (fgets(line, sizeof(line), manifest))
+    {
+        char image[512];
+        char input[512];
+        int fields = sscanf(line, "%511s %511s", image, input);
+        if (fields < 1 || image[0] == '#') { continue; }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct job* grown = realloc(*jobs, capacity * sizeof(**jobs));
+            if (!grown) { break; }
+            *jobs = grown;
+        }
+        struct job* job = &(*jobs)[count];
+        memset(job, 0, sizeof(*job));
+
+        /* jobs carry the files, so workers need not share a file system */
+        FILE* file = fopen(image, "rb");
+        if (file)
+        {
+            job->image = read_all(file, &job->image_len);
+            fclose(file);
+        }
+        file = fields == 2 ? fopen(input, "rb") : NULL;
+        if (file)
+        {
+            job->input = read_all(file, &job->input_len);
+            fclose(file);
+        }
+        if (!job->image || (fields == 2 && !job->input))
+        {
+            printf("failed to read job %d: %s", count, line);
+            fclose(manifest);
+            return -1;
+        }
+        ++count;
+    }
+    fclose(manifest);
+    return count;
+}
+
+/* send as much of a worker's frame as its socket takes, returns 0 when
+   the worker is lost */
+int worker_send(struct worker* w)
+{
+    while (w->frame && w->frame_sent < w->frame_len)
+    {
+        ssize_t n = send(w->fd, w->frame + w->frame_sent, w->frame_len - w->frame_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 1; }
+        if (n <= 0) { return 0; }
+        w->frame_sent += n;
+    }
+    free(w->frame);
+    w->frame = NULL;
+    return 1;
+}
+
+/* hand a job to a worker, it must answer within seconds */
+int send_job(struct worker* w, int32_t id, const struct job* job, uint64_t limit, uint64_t seconds)
+{
+    FILE* frame = open_memstream(&w->frame, &w->frame_len);
+    if (!frame) { return 0; }
+    put_be32(frame, id);
+    put_be64(frame, limit);
+    put_blob(frame, job->image, job->image_len);
+    put_blob(frame, job->input, job->input_len);
+    if (fclose(frame) != 0) { return 0; }
+    w->frame_sent = 0;
+    w->result_len = 0;
+    w->job = id;
+    w->deadline = monotonic_ms() + seconds * 1000;
+    return worker_send(w);
+}
+
+/* take what a worker has sent. returns 1 with r filled once its result
+   is complete, 0 while it is not, and -1 when the worker is lost */
+int recv_result(struct worker* w, struct batch_result* r)
+{
+    for (;;)
+    {
+        if (w->result_len == w->result_capacity)
+        {
+            size_t capacity = w->result_capacity ? 2 * w->result_capacity : 4096;
+            uint8_t* grown = realloc(w->result, capacity);
+            if (!grown) { return -1; }
+            w->result = grown;
+            w->result_capacity = capacity;
+        }
+        ssize_t n = recv(w->fd, w->result + w->result_len, w->result_capacity - w->result_len, 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        /* hung up, or sent something while idle */
+        if (n <= 0 || w->job < 0) { return -1; }
+        w->result_len += n;
+    }
+
+    const uint8_t* h = w->result;
+    if (w->result_len < 4 + RESULT_HEADER_SIZE) { return 0; }
+    size_t size = 4 + RESULT_HEADER_SIZE + blob_size(h + 4 + RESULT_BLOB);
+    if ((int32_t)get_be32(h) != w->job || size > JOB_RESULT_MAX) { return -1; }
+    if (w->result_len < size) { return 0; }
+    /* nothing may follow the result before the next job */
+    if (w->result_len > size) { return -1; }
+    parse_result(h + 4, r);
+    if (!result_output(h + 4, h + 4 + RESULT_HEADER_SIZE, r)) { return -1; }
+    w->result_len = 0;
+    return 1;
+}
+
+/* append a result to the stream on stdout */
+void write_result(int32_t id, const struct batch_result* r)
+{
+    put_be32(stdout, id);
+    put_result(stdout, r);
+    fflush(stdout);
+}
+
+/* a worker is gone, its job goes back in the queue or fails for good */
+void worker_lost(struct worker* w, struct job* jobs, int32_t* queue, int* queued, int* done, int* failed)
+{
+    close(w->fd);
+    w->fd = -1;
+    free(w->frame);
+    free(w->result);
+    w->frame = NULL;
+    w->result = NULL;
+    if (w->job < 0) { return; }
+    if (jobs[w->job].attempts < JOB_ATTEMPTS)
+    {
+        queue[(*queued)++] = w->job;
+    }
+    else
+    {
+        struct batch_result r = { 0 };
+        write_result(w->job, &r);
+        ++*done;
+        ++*failed;
+    }
+    w->job = -1;
+}
+
+/* run every job in the manifest on workers connecting to port, each
+   within limit instructions and seconds. returns the exit status */
+int coordinate(const char* port, const char* manifest, uint64_t limit, uint64_t seconds)
+{
+    struct job* jobs;
+    int count = read_manifest(manifest, &jobs);
+    if (count < 0) { return 1; }
+    int server = tcp_socket(NULL, port, 1);
+    if (server < 0)
+    {
+        printf("failed to listen on port: %s\n", port);
+        return 1;
+    }
+
+    /* pending jobs, taken from the end so retries run soon */
+    int32_t* queue = malloc((count + 1) * sizeof(*queue));
+    int queued = 0;
+    for (int32_t i = count - 1; i >= 0; --i) { queue[queued++] = i; }
+
+    struct worker workers[WORKERS_MAX];
+    struct pollfd polls[WORKERS_MAX + 1];
+    int worker_count = 0;
+    int done = 0;
+    int retried = 0;
+    int failed = 0;
+    int expired = 0;
+    while (done < count && !interrupted)
+    {
+        /* hand out work */
+        for (int i = 0; i < worker_count; ++i)
+        {
+            struct worker* w = &workers[i];
+            if (w->fd < 0 || w->job >= 0 || queued == 0) { continue; }
+            int32_t id = queue[--queued];
+            if (jobs[id].attempts++ > 0) { ++retried; }
+            if (!send_job(w, id, &jobs[id], limit, seconds))
+            {
+                w->job = id;
+                worker_lost(w, jobs, queue, &queued, &done, &failed);
+            }
+        }
+
+        /* forget lost workers */
+        int live = 0;
+        for (int i = 0; i < worker_count; ++i)
+        {
+            if (workers[i].fd >= 0) { workers[live++] = workers[i]; }
+        }
+        worker_count = live;
+
+        /* sleep until there is something to do or the next deadline */
+        uint64_t now = monotonic_ms();
+        int timeout = -1;
+        polls[0].fd = worker_count < WORKERS_MAX ? server : -1;
+        polls[0].events = POLLIN;
+        for (int i = 0; i < worker_count; ++i)
+        {
+            struct worker* w = &workers[i];
+            polls[i + 1].fd = w->fd;
+            polls[i + 1].events = POLLIN | (w->frame ? POLLOUT : 0);
+            polls[i + 1].revents = 0;
+            if (w->job >= 0)
+            {
+                uint64_t wait = w->deadline > now ? w->deadline - now : 0;
+                if (timeout < 0 || wait < (uint64_t)timeout) { timeout = wait < INT32_MAX ? (int)wait : INT32_MAX; }
+            }
+        }
+        if (poll(polls, worker_count + 1, timeout) < 0) { continue; }
+
+        now = monotonic_ms();
+        for (int i = 0; i < worker_count; ++i)
+        {
+            struct worker* w = &workers[i];
+            short revents = polls[i + 1].revents;
+            int status = 0;
+            struct batch_result r;
+            if ((revents & POLLOUT) && !worker_send(w)) { status = -1; }
+            if (status == 0 && (revents & (POLLIN | POLLHUP | POLLERR))) { status = recv_result(w, &r); }
+            if (status == 1)
+            {
+                write_result(w->job, &r);
+                free(r.output);
+                w->job = -1;
+                ++done;
+                /* the image did not load or the worker was interrupted */
+                if (r.status == LC3_RUNNING) { ++failed; }
+            }
+            else if (status == 0 && w->job >= 0 && now >= w->deadline)
+            {
+                /* the job never halts, or the worker stalls or trickles */
+                ++expired;
+                worker_lost(w, jobs, queue, &queued, &done, &failed);
+            }
+            else if (status < 0)
+            {
+                worker_lost(w, jobs, queue, &queued, &done, &failed);
+            }
+        }
+
+        if (polls[0].revents & POLLIN)
+        {
+            int fd = accept(server, NULL, NULL);
+            if (fd >= 0)
+            {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                /* notice nodes that vanish while running a long job */
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                memset(&workers[worker_count], 0, sizeof(workers[worker_count]));
+                workers[worker_count].fd = fd;
+                workers[worker_count].job = -1;
+                ++worker_count;
+            }
+        }
+    }
+
+    /* workers exit when the coordinator hangs up */
+    for (int i = 0; i < worker_count; ++i)
+    {
+        close(workers[i].fd);
+        free(workers[i].frame);
+        free(workers[i].result);
+    }
+    close(server);
+    fprintf(stderr, "%d of %d jobs done, %d retried (%d past their deadline), %d failed\n",
+        done - failed, count, retried, expired, failed);
+    for (int i = 0; i < count; ++i)
+    {
+        free(jobs[i].image);
+        free(jobs[i].input);
+    }
+    free(jobs);
+    free(queue);
+    return failed || done < count;
+}
+
+/* receive the bytes of a blob whose header is h */
+char* recv_blob(int fd, const uint8_t* h)
+{
+    size_t size = blob_size(h);
+    uint8_t* body = malloc(size + 1);
+    char* data = body && recv_all(fd, body, size) ? blob_bytes(h, body) : NULL;
+    free(body);
+    return data;
+}
+
+/* the worker's connection to its coordinator */
+int coordinator_sock = -1;
+
+/* SIGIO on that connection. the coordinator only sends to idle workers,
+   so while a job runs this is a hangup, after a deadline for example,
+   and the job is abandoned */
+void coordinator_hangup(int signal)
+{
+    char byte;
+    if (recv(coordinator_sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) { interrupted = 1; }
+}
+
+/* run jobs from the coordinator at address (host:port) until it hangs up */
+int work(const char* address, const char* cache_dir, uint64_t cache_limit)
+{
+    char host[256];
+    const char* port = strrchr(address, ':');
+    if (!port || port - address >= (ptrdiff_t)sizeof(host))
+    {
+        printf("expected host:port, not: %s\n", address);
+        return 1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    ++port;
+
+    /* the coordinator may still be starting */
+    int sock = -1;
+    for (int tries = 0; sock < 0 && tries < 50; ++tries)
+    {
+        sock = tcp_socket(host, port, 0);
+        if (sock < 0) { usleep(100000); }
+    }
+    if (sock < 0)
+    {
+        printf("failed to connect to: %s\n", address);
+        return 1;
+    }
+
+    coordinator_sock = sock;
+    signal(SIGIO, coordinator_hangup);
+    fcntl(sock, F_SETOWN, getpid());
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_ASYNC);
+
+    struct lc3_vm* vm = lc3_pool_alloc(1);
+    uint8_t h[JOB_HEADER_SIZE];
+    uint8_t input_h[BLOB_HEADER_SIZE];
+    while (vm && !interrupted && recv_all(sock, h, sizeof(h)))
+    {
+        size_t image_len = get_be32(h + 12);
+        size_t input_len = 0;
+        char* image = recv_blob(sock, h + 12);
+        char* input = NULL;
+        int ok = image && recv_all(sock, input_h, sizeof(input_h));
+        if (ok)
+        {
+            input_len = get_be32(input_h);
+            input = recv_blob(sock, input_h);
+            ok = input != NULL;
+        }
+
+        /* an image that does not load is reported as a failed job */
+        struct batch_result r = { 0 };
+        if (ok && lc3_init(vm))
+        {
+            FILE* file = fmemopen(image, image_len, "rb");
+            if (file && read_image_file(vm, file))
+            {
+                lc3_set_limit(vm, get_be64(h + 4));
+                ok = run_cached(vm, input, input_len, cache_dir, cache_limit, &r);
+            }
+            if (file) { fclose(file); }
+            lc3_free(vm);
+        }
+        free(image);
+        free(input);
+
+        char* data;
+        size_t size;
+        FILE* frame = ok ? open_memstream(&data, &size) : NULL;
+        if (frame)
+        {
+            put_be32(frame, get_be32(h));
+            put_result(frame, &r);
+            ok = send_stream(sock, frame, &data, &size);
+        }
+        free(r.output);
+        if (!frame || !ok) { break; }
+    }
+    close(sock);
+    lc3_pool_free(vm, 1);
+    return 0;
+}
+
+/* print a result stream as text, one job per line */
+int print_results(const char* path)
+{
+    static const char* statuses[] = {
+        [LC3_RUNNING] = "failed",
+        [LC3_HALTED] = "halted",
+        [LC3_FAULT] = "fault",
+    };
+    FILE* in = fopen(path, "rb");
+    if (!in)
+    {
+        printf("failed to read results: %s\n", path);
+        return 1;
+    }
+    uint8_t h[4 + RESULT_HEADER_SIZE];
+    while (fread(h, 1, sizeof(h), in) == sizeof(h))
+    {
+        struct batch_result r;
+        parse_result(h + 4, &r);
+        fseek(in, blob_size(h + 4 + RESULT_BLOB), SEEK_CUR);
+        const char* status = r.status < sizeof(statuses) / sizeof(*statuses) && statuses[r.status]
+            ? statuses[r.status] : "?";
+        printf("%u %s %llu instructions, %zu bytes of output", get_be32(h), status,
+            (unsigned long long)r.instructions, r.output_len);
+        if (r.status == LC3_FAULT) { printf(", %s at x%04X", fault_name(r.fault.kind), r.fault.pc); }
+        printf("\n");
+    }
+    fclose(in);
+    return 0;
+}
+
+/* ------------------- optimizer ------------------- */
+
+/*
+ * rewrites a plain .obj word for word. code reaches its data PC-relative,
+ * so no word can move without relocations the image does not carry, and
+ * rewrites only make hot paths retire fewer or cheaper instructions.
+ * code is what branches and calls reach from the entry point. words that
+ * an instruction reads, writes or takes the address of are data and never
+ * change. the result is run against the original on sample inputs before
+ * it is written, but the rewrites must be safe on every input.
+ *
+ * rewrites that rely on nothing else entering a stretch of code count
+ * as entries every branch, call and return target, every word that LEA
+ * addresses and every word whose address is stored as data. a JMP or
+ * JSRR other than RET may go anywhere, and so may a RET once R7 has been
+ * computed (ADD R7,R7,#1 to skip an inline argument), so an image with
+ * either gets none of those rewrites. R7 loaded back from memory is
+ * taken to be a saved return address.
+ */
+#define OPT_VERIFY_LIMIT 100000000
+
+enum
+{
+    OPT_CODE = 1 << 0,      /* reached as an instruction */
+    OPT_DATA = 1 << 1,      /* read, written or addressed by an instruction */
+};
+
+struct optimizer
+{
+    uint16_t origin;
+    uint32_t count;
+    uint16_t* words;                /* the image in host order, rewritten in place */
+    uint8_t* flags;                 /* OPT_* per word */
+    uint8_t* entries;               /* jumps, calls and returns landing on each word, saturating */
+    int indirect;                   /* code has a JMP or JSRR other than RET, or computes R7 */
+    uint32_t threaded;
+    uint32_t multiplies;
+    uint32_t loads;
+};
+
+int opt_in_image(const struct optimizer* o, uint32_t address)
+{
+    return address >= o->origin && address < o->origin + o->count;
+}
+
+uint16_t opt_word(const struct optimizer* o, uint16_t address)
+{
+    return o->words[address - o->origin];
+}
+
+/* a word that may be rewritten */
+int opt_is_code(const struct optimizer* o, uint32_t address)
+{
+    return opt_in_image(o, address) && (o->flags[address - o->origin] & (OPT_CODE | OPT_DATA)) == OPT_CODE;
+}
+
+void opt_enter(struct optimizer* o, uint16_t address, uint16_t* stack, uint32_t* depth)
+{
+    if (!opt_in_image(o, address)) { return; }
+    uint8_t* e = &o->entries[address - o->origin];
+    if (*e < 255) { ++*e; }
+    stack[(*depth)++] = address;
+}
+
+/* find code and data by following control flow from entry */
+int opt_analyze(struct optimizer* o, uint16_t entry)
+{
+    /* a word is pushed at most once per entry into it, up to 3 per instruction */
+    uint16_t* stack = malloc((3 * o->count + 1) * sizeof(*stack));
+    if (!stack) { return 0; }
+    uint32_t depth = 0;
+    opt_enter(o, entry, stack, &depth);
+    while (depth > 0)
+    {
+        uint16_t address = stack[--depth];
+        uint8_t* f = &o->flags[address - o->origin];
+        if (*f & OPT_CODE) { continue; }
+        *f |= OPT_CODE;
+
+        uint16_t instr = opt_word(o, address);
+        uint16_t next = address + 1;
+        uint16_t pc_offset = next + sign_extend(instr & 0x1FF, 9);
+        switch (instr >> 12)
+        {
+            case OP_BR:
+                if ((instr >> 9) & 7) { opt_enter(o, pc_offset, stack, &depth); }
+                if (((instr >> 9) & 7) != 7 && opt_in_image(o, next)) { stack[depth++] = next; }
+                break;
+            case OP_JSR:
+                if (instr & (1 << 11)) { opt_enter(o, next + sign_extend(instr & 0x7FF, 11), stack, &depth); }
+                else { o->indirect = 1; }
+                /* the call returns here */
+                opt_enter(o, next, stack, &depth);
+                break;
+            case OP_TRAP:
+                if ((instr & 0xFF) != TRAP_HALT) { opt_enter(o, next, stack, &depth); }
+                break;
+            case OP_JMP:
+                if (((instr >> 6) & 7) != R_R7) { o->indirect = 1; }
+                break;
+            case OP_RTI:
+            case OP_RES:
+                break;
+            case OP_LD:
+            case OP_LDI:
+            case OP_ST:
+            case OP_STI:
+            case OP_LEA:
+                if ((instr >> 12) == OP_LEA && ((instr >> 9) & 7) == R_R7) { o->indirect = 1; }
+                /* LEA may take the address of code too, it then counts as an entry */
+                if (opt_in_image(o, pc_offset))
+                {
+                    o->flags[pc_offset - o->origin] |= OPT_DATA;
+                    if (o->entries[pc_offset - o->origin] < 255) { ++o->entries[pc_offset - o->origin]; }
+                }
+                if (opt_in_image(o, next)) { stack[depth++] = next; }
+                break;
+            case OP_ADD:
+            case OP_AND:
+            case OP_NOT:
+                /* a RET after this returns somewhere no call returns to */
+                if (((instr >> 9) & 7) == R_R7) { o->indirect = 1; }
+                if (opt_in_image(o, next)) { stack[depth++] = next; }
+                break;
+            default:
+                if (opt_in_image(o, next)) { stack[depth++] = next; }
+                break;
+        }
+    }
+    free(stack);
+
+    /* a stored address may be loaded and jumped to */
+    for (uint32_t i = 0; i < o->count; ++i)
+    {
+        uint16_t value = o->words[i];
+        if ((o->flags[i] & (OPT_CODE | OPT_DATA)) != OPT_CODE && opt_in_image(o, value)
+            && o->entries[value - o->origin] < 255)
+        {
+            ++o->entries[value - o->origin];
+        }
+    }
+    return 1;
+}
+
+/* a branch whose target is another branch goes straight to where that one
+   leads. the flags cannot change on the way, so the second branch is
+   decided whenever the conditions of the first imply or exclude it */
+void opt_thread_branches(struct optimizer* o)
+{
+    for (uint32_t a = o->origin; a < o->origin + o->count; ++a)
+    {
+        uint16_t instr = opt_word(o, a);
+        uint16_t cond = (instr >> 9) & 7;
+        if (!opt_is_code(o, a) || instr >> 12 != OP_BR || cond == 0) { continue; }
+
+        uint16_t original = a + 1 + sign_extend(instr & 0x1FF, 9);
+        uint16_t target = original;
+        for (int hops = 0; hops < 16 && opt_is_code(o, target); ++hops)
+        {
+            uint16_t next = opt_word(o, target);
+            uint16_t next_cond = (next >> 9) & 7;
+            if (next >> 12 != OP_BR || next_cond == 0) { break; }
+            if ((cond & ~next_cond) == 0) { target = target + 1 + sign_extend(next & 0x1FF, 9); }
+            else if ((cond & next_cond) == 0) { target = target + 1; }
+            else { break; }
+        }
+
+        int16_t offset = (int16_t)(target - (uint16_t)(a + 1));
+        if (target == original || offset < -256 || offset > 255) { continue; }
+        o->words[a - o->origin] = (instr & 0xFE00) | (offset & 0x1FF);
+        ++o->threaded;
+    }
+}
+
+/*
+ *   AND Rd,Rd,#0       (the two ANDs in either order)
+ *   AND Rc,Rc,#0
+ *   ADD Rc,Rc,#k       k > 0
+ *   ADD Rd,Rd,Rs       runs k times
+ *   ADD Rc,Rc,#-1
+ *   BRp -3
+ *
+ * becomes Rd = Rs * k by doubling and adding, then AND Rc,Rc,#0 for the
+ * counter and flags the loop leaves, then a branch over what is left.
+ * k = 15 takes one word too many that way, so it goes through Rc before
+ * the counter is cleared: Rd = 3Rs, Rc = 12Rs, Rd += Rc.
+ */
+#define OPT_MULTIPLY_WORDS 6
+
+int opt_is_clear(uint16_t instr, uint16_t* r)
+{
+    *r = (instr >> 9) & 7;
+    return (instr & 0xF1FF) == (0x5020 | *r << 6);
+}
+
+void opt_multiply_loops(struct optimizer* o)
+{
+    for (uint32_t a = o->origin; a + OPT_MULTIPLY_WORDS <= o->origin + o->count; ++a)
+    {
+        const uint16_t* w = &o->words[a - o->origin];
+        uint16_t r0, r1;
+        if (!opt_is_clear(w[0], &r0) || !opt_is_clear(w[1], &r1)) { continue; }
+        uint16_t c = (w[2] >> 9) & 7;
+        uint16_t k = w[2] & 0x1F;
+        uint16_t d = c == r0 ? r1 : r0;
+        uint16_t s = w[3] & 7;
+        if ((w[2] & 0xF1E0) != (0x1020 | c << 6) || k == 0 || k > 15 || (c != r0 && c != r1) || d == c
+            || w[3] != (0x1000 | d << 9 | d << 6 | s) || s == d || s == c
+            || w[4] != (0x103F | c << 9 | c << 6) || w[5] != 0x03FD)
+        {
+            continue;
+        }
+
+        /* nothing may enter the pattern except the loop's own branch */
+        int ok = 1;
+        for (uint32_t i = 0; i < OPT_MULTIPLY_WORDS; ++i)
+        {
+            uint8_t entries = o->entries[a - o->origin + i];
+            ok &= opt_is_code(o, a + i) && (i == 0 || entries == (i == 3));
+        }
+        if (!ok) { continue; }
+
+        uint16_t code[OPT_MULTIPLY_WORDS] = { 0 };
+        uint32_t n = 0;
+        int top = 3;
+        while (!((k >> top) & 1)) { --top; }
+        if (top == 0)
+        {
+            code[n++] = 0x1020 | d << 9 | s << 6;               /* ADD Rd,Rs,#0 */
+        }
+        else if (k == 15)
+        {
+            code[n++] = 0x1000 | d << 9 | s << 6 | s;           /* ADD Rd,Rs,Rs */
+            code[n++] = 0x1000 | d << 9 | d << 6 | s;           /* ADD Rd,Rd,Rs */
+            code[n++] = 0x1000 | c << 9 | d << 6 | d;           /* ADD Rc,Rd,Rd */
+            code[n++] = 0x1000 | c << 9 | c << 6 | c;           /* ADD Rc,Rc,Rc */
+            code[n++] = 0x1000 | d << 9 | d << 6 | c;           /* ADD Rd,Rd,Rc */
+        }
+        else
+        {
+            code[n++] = 0x1000 | d << 9 | s << 6 | s;           /* ADD Rd,Rs,Rs */
+            for (int bit = top - 1; bit >= 0; --bit)
             {
-                putc((char)reg[R_R0], stdout);
-                fflush(stdout);
+                if (bit < top - 1) { code[n++] = 0x1000 | d << 9 | d << 6 | d; }  /* ADD Rd,Rd,Rd */
+                if ((k >> bit) & 1) { code[n++] = 0x1000 | d << 9 | d << 6 | s; } /* ADD Rd,Rd,Rs */
             }
-            break;
-        case TRAP_PUTS:
+        }
+        if (n + 1 > OPT_MULTIPLY_WORDS) { continue; }
+        code[n++] = 0x5020 | c << 9 | c << 6;                   /* AND Rc,Rc,#0 */
+        if (n < OPT_MULTIPLY_WORDS)
+        {
+            code[n] = 0x0E00 | (OPT_MULTIPLY_WORDS - n - 1);    /* BRnzp past the pattern */
+        }
+        memcpy(&o->words[a - o->origin], code, sizeof(code));
+        ++o->multiplies;
+        a += OPT_MULTIPLY_WORDS - 1;
+    }
+}
+
+/* LD Rx,L after LD or ST of Rx to L in the same block, with no store,
+   call or write to Rx between, becomes a register move. ADD #0 sets the
+   flags the load would have set */
+void opt_redundant_loads(struct optimizer* o)
+{
+    for (uint32_t a = o->origin; a < o->origin + o->count; ++a)
+    {
+        uint16_t instr = opt_word(o, a);
+        if (!opt_is_code(o, a) || (instr >> 12 != OP_LD && instr >> 12 != OP_ST)) { continue; }
+        uint16_t x = (instr >> 9) & 7;
+        uint16_t address = a + 1 + sign_extend(instr & 0x1FF, 9);
+        /* memory outside the image may be a device or a host window */
+        if (!opt_in_image(o, address)) { continue; }
+
+        for (uint32_t b = a + 1; opt_is_code(o, b) && o->entries[b - o->origin] == 0; ++b)
+        {
+            uint16_t next = opt_word(o, b);
+            uint16_t op = next >> 12;
+            uint16_t dr = (next >> 9) & 7;
+            if (op == OP_LD && (uint16_t)(b + 1 + sign_extend(next & 0x1FF, 9)) == address)
             {
-                /* one char per word */
-                uint16_t* c = memory + reg[R_R0];
-                while (*c)
-                {
-                    putc((char)*c, stdout);
-                    ++c;
-                }
-                fflush(stdout);
+                o->words[b - o->origin] = 0x1020 | dr << 9 | x << 6;   /* ADD Ry,Rx,#0 */
+                ++o->loads;
+                if (dr == x) { continue; }
             }
-            break;
-        case TRAP_IN:
+            int writes_x = (op == OP_ADD || op == OP_AND || op == OP_NOT || op == OP_LD || op == OP_LDI
+                || op == OP_LDR || op == OP_LEA) && dr == x;
+            int leaves_block = op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP
+                || op == OP_RTI || op == OP_RES;
+            int stores = op == OP_ST || op == OP_STI || op == OP_STR;
+            if (writes_x || leaves_block || stores) { break; }
+        }
+    }
+}
+
+/* run the original and the optimized image on input, returns 0 when they differ */
+int opt_verify(const struct optimizer* o, const uint16_t* original, const char* name, const char* input,
+    size_t input_len)
+{
+    struct lc3_vm* vms = lc3_pool_alloc(2);
+    struct batch_result r[2] = { { 0 }, { 0 } };
+    int ran = vms != NULL;
+    for (int i = 0; ran && i < 2; ++i)
+    {
+        ran = lc3_init(&vms[i]) && lc3_load_words(&vms[i], o->origin, i ? o->words : original, o->count);
+        lc3_set_limit(&vms[i], OPT_VERIFY_LIMIT);
+        ran = ran && run_batch(&vms[i], input, input_len, &r[i]);
+        if (vms[i].memory) { lc3_free(&vms[i]); }
+    }
+    lc3_pool_free(vms, 2);
+
+    int same = ran && r[0].status == r[1].status && r[0].output_len == r[1].output_len
+        && memcmp(r[0].output, r[1].output, r[0].output_len) == 0;
+    if (!ran)
+    {
+        printf("%s: could not run\n", name);
+    }
+    else if (r[0].status == LC3_FAULT && r[0].fault.kind == LC3_FAULT_LIMIT)
+    {
+        /* the optimized image gets at least as far in as many instructions,
+           so it has printed at least as much */
+        same = r[1].output_len >= r[0].output_len && memcmp(r[0].output, r[1].output, r[0].output_len) == 0;
+        printf("%s: %s for the first %u instructions\n", name, same ? "same" : "DIFFERENT", OPT_VERIFY_LIMIT);
+    }
+    else
+    {
+        printf("%s: %s, %llu -> %llu instructions\n", name, same ? "same" : "DIFFERENT",
+            (unsigned long long)r[0].instructions, (unsigned long long)r[1].instructions);
+    }
+    free(r[0].output);
+    free(r[1].output);
+    return same;
+}
+
+/* optimize the .obj at in_path, check it on every input file (or on no
+   input) and write it to out_path, returns 0 on failure */
+int optimize_image(const char* out_path, const char* in_path, const char** inputs, int input_count)
+{
+    FILE* in = fopen(in_path, "rb");
+    size_t size = 0;
+    char* buf = in ? read_all(in, &size) : NULL;
+    if (in) { fclose(in); }
+    if (!buf || size < 4 || size % 2 || memcmp(buf, XIMAGE_MAGIC, 4) == 0)
+    {
+        printf("not a plain .obj image: %s\n", in_path);
+        free(buf);
+        return 0;
+    }
+
+    struct optimizer o = { 0 };
+    o.origin = get_be16((uint8_t*)buf);
+    o.count = (size - 2) / 2;
+    if (o.count > (uint32_t)(MEMORY_MAX - o.origin)) { o.count = MEMORY_MAX - o.origin; }
+    o.words = malloc(o.count * sizeof(uint16_t));
+    uint16_t* original = malloc(o.count * sizeof(uint16_t));
+    o.flags = calloc(o.count, 1);
+    o.entries = calloc(o.count, 1);
+    int ok = o.words && original && o.flags && o.entries;
+    for (uint32_t i = 0; ok && i < o.count; ++i)
+    {
+        o.words[i] = original[i] = get_be16((uint8_t*)buf + 2 + 2 * i);
+    }
+    free(buf);
+
+    ok = ok && opt_analyze(&o, PC_START);
+    if (ok)
+    {
+        if (o.indirect)
+        {
+            printf("indirect JMP, JSRR or computed return, only branches are threaded\n");
+        }
+        else
+        {
+            opt_multiply_loops(&o);
+            opt_redundant_loads(&o);
+        }
+        /* last, the other rewrites may leave branches behind */
+        opt_thread_branches(&o);
+        uint32_t code = 0;
+        for (uint32_t i = 0; i < o.count; ++i) { code += o.flags[i] & OPT_CODE; }
+        printf("%u of %u words are code: %u branches threaded, %u multiply loops, %u loads\n", code, o.count,
+            o.threaded, o.multiplies, o.loads);
+    }
+
+    for (int i = 0; ok && i < input_count; ++i)
+    {
+        FILE* file = fopen(inputs[i], "rb");
+        size_t input_len = 0;
+        char* input = file ? read_all(file, &input_len) : NULL;
+        if (file) { fclose(file); }
+        if (!input) { printf("failed to read input: %s\n", inputs[i]); }
+        ok = input && opt_verify(&o, original, inputs[i], input, input_len);
+        free(input);
+    }
+    ok = ok && (input_count > 0 || opt_verify(&o, original, "no input", "", 0));
+
+    FILE* out = ok ? fopen(out_path, "wb") : NULL;
+    if (out)
+    {
+        put_be16(out, o.origin);
+        for (uint32_t i = 0; i < o.count; ++i) { put_be16(out, o.words[i]); }
+        ok = fclose(out) == 0;
+    }
+    else if (ok)
+    {
+        printf("failed to write image: %s\n", out_path);
+        ok = 0;
+    }
+    free(o.words);
+    free(original);
+    free(o.flags);
+    free(o.entries);
+    return ok;
+}
+
+/* ------------------- fault injection ------------------- */
+
+/*
+ * a golden run gives the reference result. the vm is then run again and
+ * stopped at each snapshot point, where forked children each flip one
+ * bit, in R0-R7, PC or a word loaded from the image, and run on with
+ * twice the golden instruction count. a child shares the parent's memory
+ * until it writes to it. a child is
+ *   masked  when it stops like the golden run with the same output
+ *   sdc     when it stops like the golden run or halts, with other output
+ *   crash   when it faults otherwise, or the host process dies
+ *   hang    when it runs out of instructions
+ */
+#define INJECT_GOLDEN_LIMIT 100000000
+#define INJECT_SNAPSHOTS 10
+
+enum
+{
+    INJECT_MASKED,
+    INJECT_SDC,
+    INJECT_CRASH,
+    INJECT_HANG,
+    INJECT_OUTCOMES
+};
+
+uint64_t splitmix64(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* flip the bit chosen by seed, half the time in a register */
+void inject_flip(struct lc3_vm* vm, uint64_t seed, const uint16_t* targets, uint32_t target_count)
+{
+    uint64_t x = splitmix64(&seed);
+    uint16_t bit = 1 << (x & 15);
+    x >>= 4;
+    if (target_count == 0 || (x & 1))
+    {
+        vm->reg[(x >> 1) % (R_PC + 1)] ^= bit;
+    }
+    else
+    {
+        vm->memory[targets[(x >> 1) % target_count]] ^= bit;
+    }
+}
+
+int inject_outcome(const struct batch_result* golden, const struct batch_result* r)
+{
+    if (r->status == LC3_RUNNING || (r->status == LC3_FAULT && r->fault.kind == LC3_FAULT_LIMIT))
+    {
+        return INJECT_HANG;
+    }
+    if (r->status != golden->status || r->fault.kind != golden->fault.kind)
+    {
+        return r->status == LC3_FAULT ? INJECT_CRASH : INJECT_SDC;
+    }
+    int same = r->output_len == golden->output_len && memcmp(r->output, golden->output, r->output_len) == 0;
+    return same ? INJECT_MASKED : INJECT_SDC;
+}
+
+/* wait for one child and count its outcome */
+void inject_reap(uint32_t* counts)
+{
+    int status;
+    while (wait(&status) < 0 && errno == EINTR) {}
+    int outcome = WIFEXITED(status) ? WEXITSTATUS(status) : INJECT_CRASH;
+    ++counts[outcome < INJECT_OUTCOMES ? outcome : INJECT_CRASH];
+}
+
+int inject_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* run a campaign of faults injected into image, returns the exit status */
+int inject(const char* image, const char* input_path, uint64_t* points, int point_count, uint32_t faults,
+    uint32_t jobs, uint64_t seed)
+{
+    size_t input_len = 0;
+    char* input = NULL;
+    FILE* file = input_path ? fopen(input_path, "rb") : NULL;
+    if (file)
+    {
+        input = read_all(file, &input_len);
+        fclose(file);
+    }
+    if (input_path && !input)
+    {
+        printf("failed to read input: %s\n", input_path);
+        return 1;
+    }
+
+    struct lc3_vm* vm = lc3_pool_alloc(1);
+    struct batch_result golden = { 0 };
+    if (!vm || !lc3_init(vm) || !lc3_load(vm, image))
+    {
+        printf("failed to load image: %s\n", image);
+        return 1;
+    }
+    lc3_set_limit(vm, INJECT_GOLDEN_LIMIT);
+    if (!run_batch(vm, input, input_len, &golden) || golden.status == LC3_RUNNING
+        || (golden.status == LC3_FAULT && golden.fault.kind == LC3_FAULT_LIMIT))
+    {
+        printf("the golden run does not finish in %u instructions\n", INJECT_GOLDEN_LIMIT);
+        return 1;
+    }
+    printf("golden run: %s, %llu instructions, %zu bytes of output\n", golden.status == LC3_HALTED ? "halted"
+        : fault_name(golden.fault.kind), (unsigned long long)golden.instructions, golden.output_len);
+
+    /* memory faults land in the words the image loaded */
+    uint16_t* targets = malloc(MEMORY_MAX * sizeof(*targets));
+    uint32_t target_count = 0;
+    for (uint32_t a = 0; targets && a < MEMORY_MAX; ++a)
+    {
+        if (vm->loaded[a >> 3] & (1 << (a & 7))) { targets[target_count++] = a; }
+    }
+
+    uint64_t spread[INJECT_SNAPSHOTS];
+    if (point_count == 0)
+    {
+        for (int i = 0; i < INJECT_SNAPSHOTS; ++i) { spread[i] = golden.instructions * i / INJECT_SNAPSHOTS; }
+        points = spread;
+        point_count = INJECT_SNAPSHOTS;
+    }
+    qsort(points, point_count, sizeof(*points), inject_compare);
+
+    /* run again, stopping at every snapshot */
+    lc3_free(vm);
+    lc3_init(vm);
+    lc3_load(vm, image);
+    lc3_set_limit(vm, 2 * golden.instructions + RUN_SLICE);
+    struct batch_result r = { 0 };
+    size_t pushed = 0;
+    size_t capacity = 0;
+
+    uint32_t totals[INJECT_OUTCOMES] = { 0 };
+    printf("%12s %8s %8s %8s %8s %8s\n", "snapshot", "faults", "masked", "sdc", "crash", "hang");
+    for (int p = 0; p < point_count && points[p] < golden.instructions; ++p)
+    {
+        if (!run_batch_until(vm, input, input_len, &pushed, points[p], &r, &capacity)) { break; }
+
+        uint32_t counts[INJECT_OUTCOMES] = { 0 };
+        uint32_t running = 0;
+        fflush(stdout);
+        for (uint32_t f = 0; f < faults; ++f)
+        {
+            if (running == jobs)
             {
-                printf("Enter a character: ");
-                char c = getchar();
-                putc(c, stdout);
-                fflush(stdout);
-                reg[R_R0] = (uint16_t)c;
-                update_flags(R_R0);
+                inject_reap(counts);
+                --running;
             }
-            break;
-        case TRAP_PUTSP:
+            pid_t pid = fork();
+            if (pid == 0)
             {
-                /* one char per byte (two bytes per word)
-                here we need to swap back to
-                big endian format */
-                uint16_t* c = memory + reg[R_R0];
-                while (*c)
-                {
-                    char char1 = (*c) & 0xFF;
-                    putc(char1, stdout);
-                    char char2 = (*c) >> 8;
-                    if (char2) putc(char2, stdout);
-                    ++c;
-                }
-                fflush(stdout);
+                inject_flip(vm, seed ^ points[p] << 20 ^ f, targets, target_count);
+                int ok = run_batch_until(vm, input, input_len, &pushed, UINT64_MAX, &r, &capacity);
+                _exit(ok ? inject_outcome(&golden, &r) : INJECT_CRASH);
             }
-            break;
-        case TRAP_HALT:
+            if (pid < 0)
             {
-                puts("HALT");
-                fflush(stdout);
-                *running = 0;
+                printf("fork failed\n");
+                break;
             }
-            break;
+            ++running;
+        }
+        for (; running > 0; --running) { inject_reap(counts); }
+
+        uint32_t n = 0;
+        for (int i = 0; i < INJECT_OUTCOMES; ++i)
+        {
+            n += counts[i];
+            totals[i] += counts[i];
+        }
+        printf("%12llu %8u %8u %8u %8u %8u\n", (unsigned long long)points[p], n, counts[INJECT_MASKED],
+            counts[INJECT_SDC], counts[INJECT_CRASH], counts[INJECT_HANG]);
     }
+
+    uint32_t n = totals[INJECT_MASKED] + totals[INJECT_SDC] + totals[INJECT_CRASH] + totals[INJECT_HANG];
+    printf("%12s %8u %8u %8u %8u %8u\n", "total", n, totals[INJECT_MASKED], totals[INJECT_SDC],
+        totals[INJECT_CRASH], totals[INJECT_HANG]);
+    lc3_free(vm);
+    lc3_pool_free(vm, 1);
+    free(targets);
+    free(golden.output);
+    free(r.output);
+    free(input);
+    return 0;
 }
 
-/* ------------------- signal management ------------------- */
+/* ------------------- main ------------------- */
 
-/* restore settings when program ends*/
-void handle_interrupt(int signal)
+#ifndef LC3_NO_MAIN
+/* show usage */
+void usage()
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    printf("lc3 [options] [image-file1] ...\n");
+    printf("  --zygote [socket]  load the images once and fork a guest per client\n");
+    printf("  --perf             name guest functions in linux perf\n");
+    printf("  --profile [file]   write folded call stacks to file, a summary to stderr\n");
+    printf("  --heatmap [prefix] write prefix.csv, prefix-windows.csv and prefix.ppm\n");
+    printf("  --sanitize         report uninitialized reads and stack misuse to stderr\n");
+    printf("  --limit [count]    fault after count instructions\n");
+    printf("  --batch            run on all of stdin as input, without a terminal\n");
+    printf("  --cache [dir]      --batch, reusing results for the same images and input\n");
+    printf("  --cache-size [MiB] least recently used results go past this, 256 by default\n");
+    printf("lc3 --connect [socket]\n");
+    printf("lc3 --coordinator [port] [--limit count] [--timeout seconds] [manifest] > [results]\n");
+    printf("  manifest lines are [image-file] [input-file], results a binary stream\n");
+    printf("  jobs stop after %d instructions and are retried after %d seconds by default\n", JOB_LIMIT, JOB_SECONDS);
+    printf("lc3 --worker [host:port] [--cache dir] [--cache-size MiB]\n");
+    printf("lc3 --results [results]\n");
+    printf("lc3 --optimize [out-file] [image-file] [input-file1] ...\n");
+    printf("lc3 --inject [--at count,...] [--faults count] [--jobs count] [--seed seed] [image-file] [input-file]\n");
+    printf("lc3 --bundle [bundle-file] [image-file1] ...\n");
+    printf("  images inside a bundle are named [bundle-file]:[image-name]\n");
+    printf("lc3 --link [out-file] [--entry address] [image-file1] ...\n");
+    exit(2);
 }
 
-/* ------------------- main ------------------- */
+/* profile written at exit */
+struct lc3_vm* profile_vm = NULL;
+const char* profile_file = NULL;
 
-int main(int argc, const char* argv[]){
-    /* to handle input in terminal */
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+void write_profile()
+{
+    FILE* folded = fopen(profile_file, "w");
+    if(!folded){
+        printf("failed to write profile: %s\n", profile_file);
+        return;
+    }
+    lc3_profile_report(profile_vm, folded, stderr);
+    fclose(folded);
+}
+
+/* heatmap written at exit */
+#define HEAT_WINDOW 100000
+struct lc3_vm* heatmap_vm = NULL;
+const char* heatmap_file = NULL;
+
+void write_heatmap()
+{
+    const char* suffixes[] = { ".csv", "-windows.csv", ".ppm" };
+    void (*writers[])(struct lc3_vm*, FILE*) = {
+        lc3_heatmap_write_csv, lc3_heatmap_write_windows, lc3_heatmap_write_ppm
+    };
+    for (int i = 0; i < 3; ++i)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s", heatmap_file, suffixes[i]);
+        FILE* out = fopen(path, "wb");
+        if(!out){
+            printf("failed to write heatmap: %s\n", path);
+            return;
+        }
+        writers[i](heatmap_vm, out);
+        fclose(out);
+    }
+    lc3_heatmap_write_ascii(heatmap_vm, stderr);
+}
 
+int main(int argc, const char* argv[]){
     if(argc < 2){
-        /* show usage */
-        printf("lc3 [image-file1] ...\n");
+        usage();
+    }
+
+    if(strcmp(argv[1], "--link") == 0){
+        int has_entry = argc > 4 && strcmp(argv[3], "--entry") == 0;
+        int first = has_entry ? 5 : 3;
+        if(argc <= first){
+            usage();
+        }
+        uint16_t entry = has_entry ? (uint16_t)strtol(argv[4] + (argv[4][0] == 'x'), NULL, 16) : 0;
+        return write_ximage(argv[2], has_entry, entry, argv + first, argc - first) ? 0 : 1;
+    }
+
+    if(strcmp(argv[1], "--bundle") == 0){
+        if(argc < 4){
+            usage();
+        }
+        return write_bundle(argv[2], argv + 3, argc - 3) ? 0 : 1;
+    }
+
+    if(strcmp(argv[1], "--connect") == 0){
+        if(argc != 3){
+            usage();
+        }
+        return zygote_connect(argv[2]);
+    }
+
+    if(strcmp(argv[1], "--coordinator") == 0){
+        uint64_t limit = JOB_LIMIT;
+        uint64_t seconds = JOB_SECONDS;
+        for(int j = 3; j + 1 < argc - 1; j += 2){
+            if(strcmp(argv[j], "--limit") == 0){
+                limit = strtoull(argv[j + 1], NULL, 10);
+            }
+            else if(strcmp(argv[j], "--timeout") == 0){
+                seconds = strtoull(argv[j + 1], NULL, 10);
+            }
+            else{
+                usage();
+            }
+        }
+        if(argc < 4 || argc % 2 == 1 || seconds == 0){
+            usage();
+        }
+        return coordinate(argv[2], argv[argc - 1], limit, seconds);
+    }
+
+    if(strcmp(argv[1], "--worker") == 0){
+        const char* cache = NULL;
+        uint64_t cache_size = 256;
+        for(int j = 3; j + 1 < argc; j += 2){
+            if(strcmp(argv[j], "--cache") == 0){
+                cache = argv[j + 1];
+            }
+            else if(strcmp(argv[j], "--cache-size") == 0){
+                cache_size = strtoull(argv[j + 1], NULL, 10);
+            }
+            else{
+                usage();
+            }
+        }
+        if(argc < 3 || argc % 2 == 0){
+            usage();
+        }
+        return work(argv[2], cache, cache_size << 20);
+    }
+
+    if(strcmp(argv[1], "--optimize") == 0){
+        if(argc < 4){
+            usage();
+        }
+        return optimize_image(argv[2], argv[3], argv + 4, argc - 4) ? 0 : 1;
+    }
+
+    if(strcmp(argv[1], "--inject") == 0){
+        uint64_t points[256];
+        int point_count = 0;
+        uint32_t faults = 100;
+        uint32_t jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t seed = 1;
+        int j = 2;
+        for(; j + 1 < argc && strncmp(argv[j], "--", 2) == 0; j += 2){
+            if(strcmp(argv[j], "--at") == 0){
+                for(char* p = (char*)argv[j + 1]; *p && point_count < 256; p += *p == ','){
+                    points[point_count++] = strtoull(p, &p, 10);
+                }
+            }
+            else if(strcmp(argv[j], "--faults") == 0){
+                faults = strtoul(argv[j + 1], NULL, 10);
+            }
+            else if(strcmp(argv[j], "--jobs") == 0){
+                jobs = strtoul(argv[j + 1], NULL, 10);
+            }
+            else if(strcmp(argv[j], "--seed") == 0){
+                seed = strtoull(argv[j + 1], NULL, 10);
+            }
+            else{
+                usage();
+            }
+        }
+        if(j == argc || argc - j > 2 || jobs == 0){
+            usage();
+        }
+        return inject(argv[j], j + 1 < argc ? argv[j + 1] : NULL, points, point_count, faults, jobs, seed);
+    }
+
+    if(strcmp(argv[1], "--results") == 0){
+        if(argc != 3){
+            usage();
+        }
+        return print_results(argv[2]);
+    }
+
+    /* options come before the images */
+    const char* zygote_socket = NULL;
+    const char* profile_path = NULL;
+    const char* heatmap_prefix = NULL;
+    int sanitize = 0;
+    uint64_t limit = 0;
+    int batch = 0;
+    const char* cache_dir = NULL;
+    uint64_t cache_size = 256;
+    int first_image = 1;
+    for(; first_image < argc && strncmp(argv[first_image], "--", 2) == 0; ++first_image){
+        if(strcmp(argv[first_image], "--zygote") == 0 && first_image + 1 < argc){
+            zygote_socket = argv[++first_image];
+        }
+        else if(strcmp(argv[first_image], "--profile") == 0 && first_image + 1 < argc){
+            profile_path = argv[++first_image];
+        }
+        else if(strcmp(argv[first_image], "--heatmap") == 0 && first_image + 1 < argc){
+            heatmap_prefix = argv[++first_image];
+        }
+        else if(strcmp(argv[first_image], "--sanitize") == 0){
+            sanitize = 1;
+        }
+        else if(strcmp(argv[first_image], "--limit") == 0 && first_image + 1 < argc){
+            limit = strtoull(argv[++first_image], NULL, 10);
+        }
+        else if(strcmp(argv[first_image], "--batch") == 0){
+            batch = 1;
+        }
+        else if(strcmp(argv[first_image], "--cache") == 0 && first_image + 1 < argc){
+            cache_dir = argv[++first_image];
+            batch = 1;
+        }
+        else if(strcmp(argv[first_image], "--cache-size") == 0 && first_image + 1 < argc){
+            cache_size = strtoull(argv[++first_image], NULL, 10);
+        }
+        else if(strcmp(argv[first_image], "--perf") == 0){
+            if(!lc3_perf_enable()){
+                printf("perf support is not available on this host\n");
+            }
+        }
+        else{
+            usage();
+        }
+    }
+    if(first_image == argc){
+        usage();
+    }
+    /* zygote guests run on the client's terminal and write no reports */
+    if(zygote_socket && (batch || profile_path || heatmap_prefix || sanitize)){
+        printf("--zygote cannot be combined with --batch, --cache, --profile, --heatmap or --sanitize\n");
         exit(2);
     }
 
-    for(int j = 1; j < argc; ++j){
-        if(!read_image(argv[j])){
+    static struct lc3_vm vm;
+    if(!lc3_init(&vm)){
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    /* images are loaded once, before any fork */
+    for(int j = first_image; j < argc; ++j){
+        if(!lc3_load(&vm, argv[j])){
             printf("failed to load image: %s\n", argv[j]);
             exit(1);
         }
     }
 
-    /* since exactly one condition flag should be set at any given time, set the Z flag */
-    reg[R_COND] = FL_ZRO;
+    /* every forked guest starts with the limit */
+    lc3_set_limit(&vm, limit);
+    if(zygote_socket){
+        zygote_serve(&vm, zygote_socket);
+    }
 
-    /* set the PC to starting position */
-    /* 0x3000 is the default */
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
+    /* to handle input in terminal */
+    catch_interrupt();
+    if(!batch){
+        disable_input_buffering();
+    }
 
-    int running = 1;
-    while (running)
-    {
-        /* FETCH */
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
+    /* written at exit, so interrupting a guest still gives a profile */
+    if(profile_path){
+        lc3_profile_enable(&vm);
+        profile_vm = &vm;
+        profile_file = profile_path;
+        atexit(write_profile);
+    }
+    if(sanitize){
+        lc3_sanitize_enable(&vm, stderr);
+    }
+    if(heatmap_prefix){
+        lc3_heatmap_enable(&vm, HEAT_WINDOW);
+        heatmap_vm = &vm;
+        heatmap_file = heatmap_prefix;
+        atexit(write_heatmap);
+    }
 
-        /* find instruction for the opcode */
-        switch (op)
-        {
-            case OP_ADD:
-                addInstr(instr);
-                break;
-            case OP_AND:
-                andInstr(instr);
-                break;
-            case OP_NOT:
-                notInstr(instr);
-                break;
-            case OP_BR:
-                brInstr(instr);
-                break;
-            case OP_JMP:
-                jmpInstr(instr);
-                break;
-            case OP_JSR:
-                jsrInstr(instr);
-                break;
-            case OP_LD:
-                ldInstr(instr);
-                break;
-            case OP_LDI:
-                ldiInstr(instr);
-                break;
-            case OP_LDR:
-                ldrInstr(instr);
-                break;
-            case OP_LEA:
-                leaInstr(instr);
-                break;
-            case OP_ST:
-                stInstr(instr);
-                break;
-            case OP_STI:
-                stiInstr(instr);
-                break;
-            case OP_STR:
-                strInstr(instr);    
-                break;
-            case OP_TRAP:
-                trapInstr(instr, &running);
-                break;
-            case OP_RES:
-                abort();
-            case OP_RTI:
-                abort();
-            default:
-                {
-                    printf("invalid opcode\n");
-                    abort();
-                }
-                break;
-        }
+    if(batch){
+        /* a hit would skip the tools, so they always run the guest */
+        int tools = profile_path || heatmap_prefix || sanitize;
+        return run_stdin(&vm, tools ? NULL : cache_dir, cache_size << 20);
     }
 
+    int status = run(&vm);
+
     /* restore terminal settings */
     restore_input_buffering();
-}
\ No newline at end of file
+    return status;
+}
+#endif
@@ -0,0 +1,309 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * embedding api: a vm is a plain struct owned by the host, loaded with
+ * lc3_load and driven by lc3_run, which never blocks. the host feeds
+ * keyboard input with lc3_push_input and drains console output with
+ * lc3_read_output whenever lc3_run returns.
+ *
+ * build lc3.c with -DLC3_NO_MAIN to link it into another program.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* memory storage */
+#define MEMORY_MAX (1 << 16)
+
+/* host side i/o buffers */
+#define LC3_INPUT_MAX 256
+#define LC3_OUTPUT_MAX 1024
+
+/* registers */
+enum{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC,   /* program counter */
+    R_COND,
+    R_COUNT
+};
+
+/* deepest guest call stack tracked for profilers */
+#define LC3_CALL_MAX 64
+
+/* why lc3_run returned */
+enum lc3_status
+{
+    LC3_RUNNING = 0,      /* internal, never returned */
+    LC3_BUDGET_EXHAUSTED, /* ran the whole budget, call again to continue */
+    LC3_NEED_INPUT,       /* the guest waits for a key, push input and call again */
+    LC3_OUTPUT_READY,     /* the guest wrote to the console, read the output */
+    LC3_HALTED,           /* the guest executed HALT */
+    LC3_FAULT,            /* the guest faulted, vm->fault says why, it stays stopped */
+    LC3_DOORBELL          /* the guest wrote to LC3_DOORBELL, call again to continue */
+};
+
+/* device register the guest writes to signal the host. the value stays
+   in vm->memory[LC3_DOORBELL], where the host may leave a reply */
+#define LC3_DOORBELL_ADDRESS 0xFE10
+
+/* windows cover whole 4 KiB host pages */
+#define LC3_WINDOW_WORDS 2048
+
+/* why a guest faulted */
+enum lc3_fault_kind
+{
+    LC3_FAULT_NONE = 0,
+    LC3_FAULT_ILLEGAL_OPCODE,       /* the reserved opcode 1101 */
+    LC3_FAULT_PRIVILEGE,            /* RTI, guests always run in user mode */
+    LC3_FAULT_LIMIT,                /* the instruction limit ran out */
+    LC3_FAULT_TRAP                  /* a native trap handler returned LC3_FAULT */
+};
+
+/* the guest state when it faulted */
+struct lc3_fault
+{
+    enum lc3_fault_kind kind;
+    uint16_t pc;                    /* address of the faulting instruction */
+    uint16_t instr;                 /* the instruction there */
+    uint16_t reg[R_COUNT];          /* registers, R_PC is pc */
+};
+
+/* a guest subroutine call */
+struct lc3_frame
+{
+    uint16_t entry;                 /* address the call jumped to */
+    uint16_t ret;                   /* address it returns to (R7 at the call) */
+};
+
+/* where guest memory lives */
+enum lc3_memory
+{
+    LC3_MEMORY_FLAT = 0,  /* one allocation, every page resident from the start */
+    LC3_MEMORY_SPARSE,    /* anonymous mapping, a page is backed once the guest touches it */
+    LC3_MEMORY_SHARED,    /* private mapping of an lc3_image, pages copied on first write */
+    LC3_MEMORY_HUGE       /* carved out of 2 MiB huge pages shared with other vms */
+};
+
+struct lc3_profile;
+struct lc3_heatmap;
+struct lc3_sanitizer;
+struct lc3_image;
+struct lc3_window;
+struct lc3_vm;
+
+/*
+ * a native trap handler, called for TRAP vector with R7 already set to the
+ * return address. it works on vm->reg and vm->memory directly. return
+ * LC3_RUNNING to go on with the next instruction, LC3_HALTED to stop the
+ * guest or LC3_FAULT to fault it. any other status is handed to the host
+ * and the trap runs again on the next lc3_run.
+ */
+typedef enum lc3_status (*lc3_trap_fn)(struct lc3_vm* vm, uint8_t vector, void* user);
+
+/* a registered handler and its argument */
+struct lc3_trap
+{
+    lc3_trap_fn fn;
+    void* user;
+};
+
+/* contexts are aligned to cache lines so vms run by different threads
+   never share one */
+#define LC3_CACHE_LINE 64
+
+/*
+ * the first cache line holds everything the interpreter touches on every
+ * instruction, the rest is cold: host i/o, trap resume state, profiling
+ * and loading. the budget is a local of the interpreter loop and dispatch
+ * is a jump table, so neither needs a slot here.
+ */
+struct lc3_vm
+{
+    /* hot */
+    uint16_t reg[R_COUNT];
+    int track_calls;                /* keep the shadow call stack */
+    uint16_t* memory;               /* 65536 locations */
+    struct lc3_heatmap* heatmap;    /* memory access heatmap, NULL when off */
+    struct lc3_sanitizer* sanitizer; /* shadow memory checks, NULL when off */
+    uint64_t instructions;          /* instructions retired so far */
+    int halted;                     /* HALT or a fault stopped the guest */
+    int trap_pending;               /* a trap stopped half way and resumes on the next lc3_run */
+
+    /* keyboard input queued by the host */
+    uint8_t input[LC3_INPUT_MAX] __attribute__((aligned(LC3_CACHE_LINE)));
+    uint32_t input_head;
+    uint32_t input_count;
+    int input_closed;               /* reads return EOF once the queue is empty */
+
+    /* console output waiting for the host, may be pending with any status */
+    char output[LC3_OUTPUT_MAX];
+    uint32_t output_len;
+
+    uint16_t trap_cursor;           /* where the pending trap goes on */
+    enum lc3_memory memory_kind;
+
+    uint64_t instruction_limit;     /* fault after this many instructions, 0 for no limit */
+    struct lc3_fault fault;
+
+    /* shadow call stack, kept while a profiler needs it. calls[0] is
+       wherever execution was when tracking started */
+    uint32_t call_depth;
+    struct lc3_frame calls[LC3_CALL_MAX];
+    struct lc3_profile* profile;    /* call graph profile, NULL when off */
+
+    /* native handlers by vector, NULL until one is registered */
+    struct lc3_trap* traps;
+
+    /* image loading */
+    int entry_point_set;
+    uint8_t loaded[MEMORY_MAX / 8]; /* one bit per word claimed by an image */
+} __attribute__((aligned(LC3_CACHE_LINE)));
+
+/* count zeroed, cache line aligned contexts in one block. the pages are
+   placed on the numa node of the calling thread, so call it from the
+   thread that will run them */
+struct lc3_vm* lc3_pool_alloc(uint32_t count);
+
+/* free a block from lc3_pool_alloc, lc3_free each vm first */
+void lc3_pool_free(struct lc3_vm* pool, uint32_t count);
+
+/* set up a vm as an empty machine starting at 0x3000, with flat memory.
+   returns 0 when memory cannot be allocated. lc3_free releases it */
+int lc3_init(struct lc3_vm* vm);
+
+/* lc3_init with memory from another backend, LC3_MEMORY_SHARED needs
+   lc3_init_image */
+int lc3_init_memory(struct lc3_vm* vm, enum lc3_memory kind);
+
+/* snapshot the memory and entry point of a loaded vm, so that many vms
+   can start from it sharing the pages they never write */
+struct lc3_image* lc3_image_create(const struct lc3_vm* vm);
+
+/* lc3_init with LC3_MEMORY_SHARED memory holding image, ready to run */
+int lc3_init_image(struct lc3_vm* vm, const struct lc3_image* image);
+
+/* vms made from an image keep working after it is freed */
+void lc3_image_free(struct lc3_image* image);
+
+/* a host buffer of words (a multiple of LC3_WINDOW_WORDS) that vms can
+   map into their address space */
+struct lc3_window* lc3_window_create(uint32_t words);
+
+/* the host's view of the window, in host order */
+uint16_t* lc3_window_data(const struct lc3_window* window);
+
+/* map window at address, a multiple of LC3_WINDOW_WORDS below the device
+   registers. guest and host then see each other's writes with no copy.
+   fails over loaded images and on LC3_MEMORY_HUGE */
+int lc3_window_map(struct lc3_vm* vm, const struct lc3_window* window, uint16_t address);
+
+/* vms keep their mapping after the window is freed */
+void lc3_window_free(struct lc3_window* window);
+
+/* release the memory of a vm, its trap handlers and any profiler,
+   heatmap or sanitizer */
+void lc3_free(struct lc3_vm* vm);
+
+/* load an .obj, an extended image or bundle:name, returns 0 on failure */
+int lc3_load(struct lc3_vm* vm, const char* image_path);
+
+/* load words already in host order at origin, returns 0 on overlap */
+int lc3_load_words(struct lc3_vm* vm, uint16_t origin, const uint16_t* words, uint32_t count);
+
+/* run at most budget instructions */
+enum lc3_status lc3_run(struct lc3_vm* vm, uint64_t budget);
+
+/* fault with LC3_FAULT_LIMIT once the guest has retired limit
+   instructions in total, 0 removes the limit */
+void lc3_set_limit(struct lc3_vm* vm, uint64_t limit);
+
+/* call fn for TRAP vector instead of the built-in trap or, for vectors
+   without one, instead of doing nothing. a NULL fn restores the default.
+   returns 0 when the table cannot be allocated */
+int lc3_trap_register(struct lc3_vm* vm, uint8_t vector, lc3_trap_fn fn, void* user);
+
+/* one line naming the fault, then the registers */
+void lc3_fault_report(const struct lc3_vm* vm, FILE* out);
+
+/* queue keyboard input, returns how many bytes fit */
+size_t lc3_push_input(struct lc3_vm* vm, const char* data, size_t size);
+
+/* no more input will come, reads see EOF */
+void lc3_close_input(struct lc3_vm* vm);
+
+/* take up to size bytes of console output, returns how many were copied */
+size_t lc3_read_output(struct lc3_vm* vm, char* data, size_t size);
+
+/* count instructions per guest call stack from now on */
+int lc3_profile_enable(struct lc3_vm* vm);
+
+/* write folded stacks (flamegraph.pl input) and/or a table of inclusive
+   and exclusive instruction counts per function, either may be NULL */
+void lc3_profile_report(struct lc3_vm* vm, FILE* folded, FILE* table);
+
+/* stop profiling and free the profile */
+void lc3_profile_free(struct lc3_vm* vm);
+
+/* count reads, writes and fetches per 256-word page, and the pages
+   touched in every window of window_length instructions */
+int lc3_heatmap_enable(struct lc3_vm* vm, uint32_t window_length);
+
+/* page,address,reads,writes,executes */
+void lc3_heatmap_write_csv(struct lc3_vm* vm, FILE* out);
+
+/* window,first_instruction,pages,words: the working set of each window */
+void lc3_heatmap_write_windows(struct lc3_vm* vm, FILE* out);
+
+/* 256x256 ppm of the address space, one 16x16 block per page:
+   red for writes, green for fetches, blue for reads */
+void lc3_heatmap_write_ppm(struct lc3_vm* vm, FILE* out);
+
+/* 16x16 character map of the pages and a working set summary */
+void lc3_heatmap_write_ascii(struct lc3_vm* vm, FILE* out);
+
+void lc3_heatmap_free(struct lc3_vm* vm);
+
+/* report reads and fetches of uninitialized words, writes over executed
+   code and R6 stack misuse to report, with the guest call stack. enable
+   after loading the images, they count as initialized */
+int lc3_sanitize_enable(struct lc3_vm* vm, FILE* report);
+
+/* number of problems reported so far */
+uint32_t lc3_sanitize_count(struct lc3_vm* vm);
+
+void lc3_sanitize_free(struct lc3_vm* vm);
+
+/* attribute host time to guest functions in linux perf (perf map and
+   jitdump), returns 0 when the host is not supported */
+int lc3_perf_enable(void);
+
+/* the native address perf sees for the guest function at entry, or NULL */
+const void* lc3_perf_address(uint16_t entry);
+
+/* lz16, the word compressor behind extended images, cached results and
+   batch frames. the compressed size is at most lz16_bound(count) words */
+#define LZ16_ERROR 0xFFFFFFFF
+uint32_t lz16_bound(uint32_t count);
+uint32_t lz16_compress(const uint16_t* in, uint32_t count, uint16_t* out);
+
+/* decompress into out (at most max words), returns the words written or LZ16_ERROR */
+uint32_t lz16_decompress(const uint16_t* in, uint32_t count, uint16_t* out, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
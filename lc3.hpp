@@ -0,0 +1,497 @@
+#ifndef LC3_HPP
+#define LC3_HPP
+
+/*
+ * c++20 layer over the embedding api: every guest is a coroutine task.
+ * when the guest waits for a key the task co_awaits its input source,
+ * when it prints the task co_awaits its output sink, and when its slice
+ * of instructions is spent it yields to the work stealing executor, so a
+ * few threads drive any number of guests.
+ *
+ * header only, link with lc3.c built with -DLC3_NO_MAIN.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "lc3.h"
+
+namespace lc3 {
+
+/* ------------------- task ------------------- */
+
+/* a lazily started coroutine, resumed by whoever co_awaits it */
+class task
+{
+public:
+    struct promise_type
+    {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr error;
+
+        task get_return_object() { return task(handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        /* hand control straight back to the awaiting coroutine */
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(handle h) noexcept { return h.promise().continuation; }
+                void await_resume() noexcept {}
+            };
+            return awaiter{};
+        }
+
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    task(task&& other) noexcept : h_(std::exchange(other.h_, {})) {}
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (h_) { h_.destroy(); }
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+    ~task() { if (h_) { h_.destroy(); } }
+
+    /* start the task and resume the caller when it finishes */
+    auto operator co_await() && noexcept
+    {
+        struct awaiter
+        {
+            handle h;
+            bool await_ready() noexcept { return !h || h.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+            {
+                h.promise().continuation = caller;
+                return h;
+            }
+            void await_resume()
+            {
+                if (h.promise().error) { std::rethrow_exception(h.promise().error); }
+            }
+        };
+        return awaiter{ h_ };
+    }
+
+private:
+    explicit task(handle h) : h_(h) {}
+    handle h_;
+};
+
+/* ------------------- executor ------------------- */
+
+/*
+ * a fixed pool of workers, each with its own queue. a worker runs its
+ * own queue in order and steals from the back of the others when empty.
+ */
+class executor
+{
+public:
+    explicit executor(unsigned threads = std::thread::hardware_concurrency())
+        : queues_(threads ? threads : 1)
+    {
+        for (unsigned i = 0; i < queues_.size(); ++i)
+        {
+            workers_.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    executor(const executor&) = delete;
+    executor& operator=(const executor&) = delete;
+
+    ~executor()
+    {
+        drain();
+        /* a task failed and nobody called wait() to hear about it */
+        if (error_) { std::terminate(); }
+        {
+            std::lock_guard lock(idle_mutex_);
+            stopping_ = true;
+        }
+        idle_.notify_all();
+        for (auto& worker : workers_) { worker.join(); }
+    }
+
+    /* co_await ex.schedule() continues the coroutine on a worker */
+    auto schedule() noexcept
+    {
+        struct awaiter
+        {
+            executor* ex;
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { ex->post(h); }
+            void await_resume() noexcept {}
+        };
+        return awaiter{ this };
+    }
+
+    /* let the other coroutines on this worker run first */
+    auto yield() noexcept { return schedule(); }
+
+    /* run a task to completion on the pool, wait() waits for all of them */
+    void spawn(task t)
+    {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        detach(std::move(t));
+    }
+
+    /* block until every spawned task has finished, then rethrow the
+       first exception that escaped one of them */
+    void wait()
+    {
+        drain();
+        std::exception_ptr error;
+        {
+            std::lock_guard lock(idle_mutex_);
+            error = std::exchange(error_, nullptr);
+        }
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    std::size_t size() const noexcept { return queues_.size(); }
+
+    /* totals over all workers, read them once the work is done */
+    struct stats
+    {
+        std::uint64_t resumed = 0;  /* coroutines run */
+        std::uint64_t stolen = 0;   /* of those, taken from another worker's queue */
+        std::uint64_t slept = 0;    /* times a worker found nothing and waited */
+    };
+
+    stats statistics() const noexcept
+    {
+        stats total;
+        for (const queue& q : queues_)
+        {
+            total.resumed += q.resumed.load(std::memory_order_relaxed);
+            total.stolen += q.stolen.load(std::memory_order_relaxed);
+            total.slept += q.slept.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+private:
+    /* one per worker, on its own cache lines so workers never share one */
+    struct alignas(64) queue
+    {
+        std::mutex mutex;
+        std::deque<std::coroutine_handle<>> items;
+        /* only written by the owning worker */
+        std::atomic<std::uint64_t> resumed{ 0 };
+        std::atomic<std::uint64_t> stolen{ 0 };
+        std::atomic<std::uint64_t> slept{ 0 };
+    };
+
+    /* a fire and forget coroutine that frees itself */
+    struct detached
+    {
+        struct promise_type
+        {
+            detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    detached detach(task t)
+    {
+        co_await schedule();
+        try
+        {
+            co_await std::move(t);
+        }
+        catch (...)
+        {
+            std::lock_guard lock(idle_mutex_);
+            if (!error_) { error_ = std::current_exception(); }
+        }
+        finished();
+    }
+
+    void drain()
+    {
+        std::unique_lock lock(idle_mutex_);
+        done_.wait(lock, [this] { return pending_.load(std::memory_order_acquire) == 0; });
+    }
+
+    void finished()
+    {
+        if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::lock_guard lock(idle_mutex_);
+            done_.notify_all();
+        }
+    }
+
+    /* queue a coroutine, on the current worker when called from one */
+    void post(std::coroutine_handle<> h)
+    {
+        std::size_t i = current_ == this ? index_ : next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        {
+            std::lock_guard lock(queues_[i].mutex);
+            queues_[i].items.push_back(h);
+        }
+        queued_.fetch_add(1);
+        /* seq_cst pairs with the check in work() so no wakeup is lost */
+        if (sleeping_.load() > 0)
+        {
+            std::lock_guard lock(idle_mutex_);
+            idle_.notify_one();
+        }
+    }
+
+    /* own queue first, then steal from the others */
+    std::coroutine_handle<> take(std::size_t self)
+    {
+        for (std::size_t k = 0; k < queues_.size(); ++k)
+        {
+            queue& q = queues_[(self + k) % queues_.size()];
+            std::lock_guard lock(q.mutex);
+            if (q.items.empty()) { continue; }
+            std::coroutine_handle<> h;
+            if (k == 0)
+            {
+                h = q.items.front();
+                q.items.pop_front();
+            }
+            else
+            {
+                h = q.items.back();
+                q.items.pop_back();
+            }
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            if (k != 0) { count(queues_[self].stolen); }
+            return h;
+        }
+        return {};
+    }
+
+    /* single writer, so no read-modify-write is needed */
+    static void count(std::atomic<std::uint64_t>& counter) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void work(std::size_t self)
+    {
+        current_ = this;
+        index_ = self;
+        for (;;)
+        {
+            if (auto h = take(self))
+            {
+                count(queues_[self].resumed);
+                h.resume();
+                continue;
+            }
+
+            count(queues_[self].slept);
+            std::unique_lock lock(idle_mutex_);
+            sleeping_.fetch_add(1);
+            idle_.wait(lock, [this] { return stopping_ || queued_.load() > 0; });
+            sleeping_.fetch_sub(1, std::memory_order_acq_rel);
+            if (stopping_ && queued_.load(std::memory_order_acquire) == 0) { return; }
+        }
+    }
+
+    std::vector<queue> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> next_{ 0 };
+    std::atomic<std::size_t> queued_{ 0 };
+    std::atomic<std::size_t> pending_{ 0 };
+    std::atomic<unsigned> sleeping_{ 0 };
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+    std::condition_variable done_;
+    bool stopping_ = false;
+    std::exception_ptr error_;          /* first exception out of a spawned task */
+
+    static inline thread_local executor* current_ = nullptr;
+    static inline thread_local std::size_t index_ = 0;
+};
+
+/* ------------------- i/o ------------------- */
+
+/*
+ * an input source is awaited for keys: co_await in.read(buf) gives the
+ * number of bytes read, 0 at end of input. sources may also offer a
+ * non-awaiting try_read(buf), used between slices so guests polling
+ * KBSR see keys without asking for them.
+ */
+template <class S>
+concept input_source = requires(S& s, std::span<char> buf) {
+    { s.read(buf).await_resume() } -> std::convertible_to<std::size_t>;
+};
+
+/* an output sink is awaited with every chunk of console output */
+template <class S>
+concept output_sink = requires(S& s, std::string_view text) {
+    s.write(text).await_resume();
+};
+
+/* input from a string, always ready */
+class string_source
+{
+public:
+    explicit string_source(std::string text) : text_(std::move(text)) {}
+
+    auto read(std::span<char> buf) noexcept
+    {
+        struct awaiter
+        {
+            std::size_t n;
+            bool await_ready() noexcept { return true; }
+            void await_suspend(std::coroutine_handle<>) noexcept {}
+            std::size_t await_resume() noexcept { return n; }
+        };
+        return awaiter{ try_read(buf) };
+    }
+
+    std::size_t try_read(std::span<char> buf) noexcept
+    {
+        std::size_t n = std::min(buf.size(), text_.size() - pos_);
+        text_.copy(buf.data(), n, pos_);
+        pos_ += n;
+        return n;
+    }
+
+private:
+    std::string text_;
+    std::size_t pos_ = 0;
+};
+
+/* output collected into a string */
+class string_sink
+{
+public:
+    std::suspend_never write(std::string_view text)
+    {
+        text_.append(text);
+        return {};
+    }
+
+    const std::string& str() const noexcept { return text_; }
+
+private:
+    std::string text_;
+};
+
+/* ------------------- guests ------------------- */
+
+/* run a loaded vm to HALT or a fault as a coroutine on ex. the guest
+   yields after every slice instructions, counted across the returns for
+   output and the doorbell so a guest that prints cannot keep its worker */
+template <input_source In, output_sink Out>
+task run_guest(executor& ex, lc3_vm& vm, In& in, Out& out, std::uint64_t slice = 1 << 16)
+{
+    char buf[LC3_OUTPUT_MAX];
+    std::uint64_t left = slice;
+    for (;;)
+    {
+        std::uint64_t start = vm.instructions;
+        enum lc3_status status = lc3_run(&vm, left);
+        std::uint64_t ran = vm.instructions > start ? vm.instructions - start : 0;
+        left -= std::min(ran, left);
+
+        if (vm.output_len > 0)
+        {
+            std::size_t n = lc3_read_output(&vm, buf, sizeof(buf));
+            co_await out.write(std::string_view(buf, n));
+        }
+
+        switch (status)
+        {
+            case LC3_NEED_INPUT:
+                {
+                    std::size_t n = co_await in.read(std::span<char>(buf, LC3_INPUT_MAX - vm.input_count));
+                    if (n == 0) { lc3_close_input(&vm); }
+                    lc3_push_input(&vm, buf, n);
+                }
+                break;
+            case LC3_HALTED:
+            case LC3_FAULT:
+                co_return;
+            default:
+                break;
+        }
+
+        if (left == 0)
+        {
+            if constexpr (requires { in.try_read(std::span<char>(buf, 1)); })
+            {
+                if (vm.input_count < LC3_INPUT_MAX && !vm.input_closed)
+                {
+                    std::size_t n = in.try_read(std::span<char>(buf, LC3_INPUT_MAX - vm.input_count));
+                    lc3_push_input(&vm, buf, n);
+                }
+            }
+            co_await ex.yield();
+            left = slice;
+        }
+    }
+}
+
+/* a vm owned by c++ code */
+struct vm
+{
+    explicit vm(lc3_memory kind = LC3_MEMORY_FLAT) : state(std::make_unique<lc3_vm>())
+    {
+        if (!lc3_init_memory(state.get(), kind)) { throw std::bad_alloc(); }
+    }
+    explicit vm(const lc3_image& image) : state(std::make_unique<lc3_vm>())
+    {
+        if (!lc3_init_image(state.get(), &image)) { throw std::bad_alloc(); }
+    }
+    vm(vm&&) noexcept = default;
+    vm& operator=(vm&& other) noexcept
+    {
+        if (state) { lc3_free(state.get()); }
+        state = std::move(other.state);
+        return *this;
+    }
+    ~vm() { if (state) { lc3_free(state.get()); } }
+
+    bool load(const char* image_path) { return lc3_load(state.get(), image_path) != 0; }
+
+    /* see lc3_trap_register */
+    void on_trap(std::uint8_t vector, lc3_trap_fn fn, void* user = nullptr)
+    {
+        if (!lc3_trap_register(state.get(), vector, fn, user)) { throw std::bad_alloc(); }
+    }
+
+    lc3_vm& operator*() noexcept { return *state; }
+    lc3_vm* operator->() noexcept { return state.get(); }
+
+    std::unique_ptr<lc3_vm> state;
+};
+
+} /* namespace lc3 */
+
+#endif
@@ -0,0 +1,20 @@
+#!/bin/sh
+# run each image with the delay loop skip and with --heatmap, which steps
+# every instruction, and require the same final registers
+vm=${1:-./lc3_vm}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+status=0
+for image in "$dir"/*.obj; do
+    name=$(basename "$image" .obj)
+    "$vm" --batch "$image" < /dev/null 2>&1 | grep -E '^(R0|R4|PC) ' > "$tmp/fast"
+    "$vm" --heatmap "$tmp/heat" --batch "$image" < /dev/null 2>&1 | grep -E '^(R0|R4|PC) ' > "$tmp/stepped"
+    if [ -s "$tmp/fast" ] && cmp -s "$tmp/fast" "$tmp/stepped"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        status=1
+    fi
+done
+exit $status
@@ -0,0 +1,11 @@
+; jumps into a BRp / ADD R1,R1,#-1 delay loop on R2's flags while R1 is
+; already 0. the ADD must still run once and leave R1 at -1. RTI faults
+; so the registers are printed.
+        .ORIG x3000
+        AND  R1, R1, #0
+        ADD  R2, R1, #1
+        BRnzp TEST
+LOOP    ADD  R1, R1, #-1
+TEST    BRp  LOOP
+        RTI
+        .END
@@ -0,0 +1,33 @@
+#!/bin/sh
+# optimize each image against empty input, then require the same output
+# as the original on every input file next to it (NAME.*.txt), and the
+# line in NAME.expect, if any, in what the optimizer printed
+vm=${1:-./lc3_vm}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+status=0
+for image in "$dir"/*.obj; do
+    name=$(basename "$image" .obj)
+    if ! "$vm" --optimize "$tmp/$name.obj" "$image" > "$tmp/summary"; then
+        echo "FAIL $name optimize"
+        status=1
+        continue
+    fi
+    if [ -e "$dir/$name.expect" ] && ! grep -qF -f "$dir/$name.expect" "$tmp/summary"; then
+        echo "FAIL $name expected: $(cat "$dir/$name.expect")"
+        status=1
+    fi
+    for input in "$dir/$name".*.txt; do
+        [ -e "$input" ] || continue
+        "$vm" --batch "$image" < "$input" > "$tmp/expected" || true
+        "$vm" --batch "$tmp/$name.obj" < "$input" > "$tmp/actual" || true
+        if cmp -s "$tmp/expected" "$tmp/actual"; then
+            echo "ok   $name $(basename "$input")"
+        else
+            echo "FAIL $name $(basename "$input")"
+            status=1
+        fi
+    done
+done
+exit $status
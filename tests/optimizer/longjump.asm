@@ -0,0 +1,26 @@
+; reaches the second LD R1,L both by falling through and by JMP R3.
+; an optimizer that only follows direct branches sees one block and turns
+; that LD into a move, which prints 0 for x instead of 7.
+        .ORIG x3000
+        GETC
+        LD   R2, NEGX
+        ADD  R2, R2, R0
+        BRz  LONG           ; x takes the indirect path
+        LD   R1, L
+AGAIN   LD   R1, L          ; must stay a load
+        LD   R0, ZERO
+        ADD  R0, R0, R1
+        OUT
+        LD   R0, NL
+        OUT
+        HALT
+LONG    AND  R1, R1, #0
+        LD   R3, PTR
+        JMP  R3
+        .FILL x0000
+NEGX    .FILL xFF88         ; -'x'
+L       .FILL 7
+ZERO    .FILL x0030         ; '0'
+NL      .FILL x000A
+PTR     .FILL AGAIN
+        .END
@@ -0,0 +1,22 @@
+; multiplies the digit typed by 15 with a counted ADD loop, the largest
+; constant the optimizer rewrites, and prints the product plus '0'
+        .ORIG x3000
+        GETC
+        LD   R4, NEG0
+        ADD  R1, R0, R4
+        AND  R2, R2, #0
+        AND  R3, R3, #0
+        ADD  R3, R3, #15
+MUL     ADD  R2, R2, R1
+        ADD  R3, R3, #-1
+        BRp  MUL
+        LD   R0, ZERO
+        ADD  R0, R0, R2
+        OUT
+        LD   R0, NL
+        OUT
+        HALT
+NEG0    .FILL xFFD0         ; -'0'
+ZERO    .FILL x0030         ; '0'
+NL      .FILL x000A
+        .END
@@ -0,0 +1,25 @@
+; SKIP returns past the word after its call when the key is x. that word
+; decodes as LD R1,L, so the LD R1,L after it looks redundant, but on x
+; it is where the call returns and it must stay a load.
+        .ORIG x3000
+        GETC
+        JSR  SKIP
+        LD   R1, L          ; inline argument, skipped on x
+        LD   R1, L          ; must stay a load
+        LD   R0, ZERO
+        ADD  R0, R0, R1
+        OUT
+        LD   R0, NL
+        OUT
+        HALT
+SKIP    AND  R1, R1, #0
+        LD   R2, NEGX
+        ADD  R2, R2, R0
+        BRnp DONE
+        ADD  R7, R7, #1
+DONE    RET
+L       .FILL 7
+ZERO    .FILL x0030         ; '0'
+NL      .FILL x000A
+NEGX    .FILL xFF88         ; -'x'
+        .END